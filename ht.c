@@ -0,0 +1,1916 @@
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/ctype.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/log2.h>
+#include <linux/cache.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/siphash.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/overflow.h>
+#endif
+#include "ht.h"
+
+#undef  pr_fmt
+#define pr_fmt(fmt) "ko_test_device: " fmt
+
+#define DEFAULT_MAX_LOAD_FACTOR 100
+// items per 100 buckets, the table grows above it
+unsigned int ht_max_load_factor = DEFAULT_MAX_LOAD_FACTOR;
+// memory budget of the items in bytes, 0 if unlimited. Above it writers
+// evict cold items, see ht_evict
+unsigned long ht_max_bytes;
+#define DEFAULT_PAGED_VALUE_MIN (16 * 1024)
+// values of at least this many bytes are allocated with vmalloc_user, so
+// they can be mapped to user space without a copy. 0 if none are
+unsigned int ht_paged_value_min = DEFAULT_PAGED_VALUE_MIN;
+
+// objects up to the largest size class come from the dedicated caches,
+// larger ones from kmalloc. The caches are shared by all tables
+static const unsigned int ht_item_sizes[] = { 128, 256, 512, 1024 };
+static const char *const ht_item_cache_names[] = {
+	"ko_test_item_128", "ko_test_item_256",
+	"ko_test_item_512", "ko_test_item_1024",
+};
+static struct kmem_cache *ht_item_caches[ARRAY_SIZE(ht_item_sizes)];
+static DEFINE_MUTEX(ht_caches_lock);
+static unsigned int ht_caches_users;
+
+// chain length distribution is kept up to date by writers, the last slot
+// counts all longer chains, see HT_CHAIN_SLOTS
+struct ht_bucket_table {
+	unsigned int size;
+	unsigned int bits;
+	unsigned int gen;
+	// number of buckets of each chain length
+	atomic_t chains[HT_CHAIN_SLOTS];
+	// chain length of every bucket, changed under the bucket lock
+	unsigned int *lengths;
+	// buckets of each chain length from HT_CHAIN_SLOTS - 1 up and the
+	// longest chain, under long_lock. Chains longer than HT_LONG_CHAINS or
+	// the table size share the last entry, the longest of them is kept
+	// until they all shrink
+	spinlock_t long_lock;
+	unsigned int long_max;
+	unsigned int *long_chains;
+	// bit per non-empty bucket, iterators skip empty ones with it
+	unsigned long *occupied;
+	// HT_OPEN tables only: the lookup index, see ht_group_find, and a bit
+	// per stripe which did not fit into it
+	unsigned int group_bits;
+	struct ht_group *groups;
+	unsigned long *overflow;
+	struct hlist_head buckets[];
+};
+
+// open addressing lookup index. A group is a word of 1-byte tags, which
+// is compared with a tag at once (SWAR), and the items of the tags. Items
+// stay in the chains as well, iterators and resize use them
+#define HT_GROUP_SLOTS sizeof(unsigned long)
+#define HT_TAG_EMPTY 0x00
+#define HT_TAG_DELETED 0x01
+// a full slot has the high bit and 7 low bits of the hash
+#define HT_TAG_FULL 0x80
+
+struct ht_group {
+	unsigned long tags;
+	struct ht_item __rcu *items[HT_GROUP_SLOTS];
+};
+
+// writers are serialized per lock stripe. Bucket index is taken from the
+// high bits of hash_long(), so every stripe covers a contiguous range of
+// buckets both before and after a resize. Mutexes are used because
+// publishing an item in sysfs may sleep
+#define HT_MAX_LOCK_BITS 8
+// max buckets migrated under one stripe lock
+#define HT_MIGRATE_CHUNK 64
+#define HT_MAX_BITS 26
+// chain lengths counted exactly above HT_CHAIN_SLOTS in small tables
+#define HT_LONG_CHAINS 1024
+// the expire sweep passes the table once a period in parts
+#define HT_EXPIRE_PERIOD_MS 1000
+#define HT_EXPIRE_PARTS 8
+
+// a key always maps to the same stripe, so versions given out by the
+// stripe counter grow for every key, across delete and add too
+struct ht_lock {
+	struct mutex lock;
+	u64 version;
+} ____cacheline_aligned_in_smp;
+
+// counters are per-CPU, so updating them does not bounce a shared line
+// between writers. Readers sum them up, see ht_stat_sum
+struct ht_stats {
+	unsigned long ops[HT_STAT_COUNT];
+	unsigned long hist[HT_HIST_COUNT][HT_HIST_SLOTS];
+};
+
+static void ht_resize_worker(struct work_struct *work);
+static void ht_expire_worker(struct work_struct *work);
+
+// taken from http://www.cse.yorku.ca/~oz/hash.html
+static unsigned long djb2n(const char *str, int size)
+{
+	unsigned long hash = 5381;
+	int i;
+
+	for (i = 0; i < size; i++)
+		hash = ((hash << 5) + hash) + (unsigned char)str[i]; /* hash * 33 + c */
+	return hash;
+}
+
+// siphash is keyed by a random seed, so crafted keys cannot be used to
+// flood one bucket. djb2 is kept for comparison
+unsigned long ht_hash(struct ht *ht, const char *key, int size)
+{
+	if (ht->use_djb2)
+		return djb2n(key, size);
+	return (unsigned long)siphash(key, size, &ht->hash_key);
+}
+
+static int ht_hash_init(struct ht *ht, const char *hash_function)
+{
+	ht->use_djb2 = false;
+	if (strcmp(hash_function, "djb2") == 0)
+		ht->use_djb2 = true;
+	else if (strcmp(hash_function, "siphash") == 0)
+		get_random_bytes(&ht->hash_key, sizeof(ht->hash_key));
+	else {
+		pr_err("unknown hash_function %s\n", hash_function);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// ht->lock_bits must be set
+static struct ht_bucket_table *ht_alloc_table(struct ht *ht, unsigned int bits,
+						unsigned int gen)
+{
+	struct ht_bucket_table *tbl;
+	size_t size, groups_offset = 0;
+	unsigned int i, group_bits = 0;
+	unsigned int load = READ_ONCE(ht_max_load_factor) ?: DEFAULT_MAX_LOAD_FACTOR;
+
+	size = sizeof(struct ht_bucket_table) +
+		(sizeof(struct hlist_head) + sizeof(unsigned int)) * (1UL << bits) +
+		BITS_TO_LONGS(1UL << bits) * sizeof(unsigned long) +
+		sizeof(unsigned int) * max_t(unsigned long, 1UL << bits, HT_LONG_CHAINS);
+	if (ht->open) {
+		// at least two slots per item at the max load factor up to 1600,
+		// so probes stay short; every stripe owns at least one group
+		group_bits = bits + 1 + min(fls((load - 1) / 100), 4);
+		group_bits = max_t(int, group_bits - ilog2(HT_GROUP_SLOTS), ht->lock_bits);
+		groups_offset = ALIGN(size, sizeof(unsigned long));
+		size = groups_offset + BITS_TO_LONGS(1UL << ht->lock_bits) * sizeof(unsigned long) +
+			sizeof(struct ht_group) * (1UL << group_bits);
+	}
+	tbl = kvzalloc(size, GFP_KERNEL);
+	if (tbl == NULL)
+		return NULL;
+	tbl->size = 1U << bits;
+	tbl->bits = bits;
+	tbl->gen = gen;
+	atomic_set(&tbl->chains[0], tbl->size);
+	tbl->occupied = (unsigned long *)&tbl->buckets[tbl->size];
+	tbl->lengths = (unsigned int *)&tbl->occupied[BITS_TO_LONGS(tbl->size)];
+	tbl->long_chains = &tbl->lengths[tbl->size];
+	spin_lock_init(&tbl->long_lock);
+	if (ht->open) {
+		tbl->group_bits = group_bits;
+		tbl->overflow = (unsigned long *)((char *)tbl + groups_offset);
+		tbl->groups = (struct ht_group *)&tbl->overflow[BITS_TO_LONGS(1UL << ht->lock_bits)];
+	}
+	for (i = 0; i < tbl->size; i++)
+		INIT_HLIST_HEAD(&tbl->buckets[i]);
+	return tbl;
+}
+
+static void ht_destroy_caches(void)
+{
+	int i;
+
+	mutex_lock(&ht_caches_lock);
+	if (--ht_caches_users == 0) {
+		for (i = 0; i < ARRAY_SIZE(ht_item_sizes); i++) {
+			kmem_cache_destroy(ht_item_caches[i]);
+			ht_item_caches[i] = NULL;
+		}
+	}
+	mutex_unlock(&ht_caches_lock);
+}
+
+// created by the first table, the last ht_destroy_caches destroys them.
+// On failure the caller still calls ht_destroy_caches
+static int ht_create_caches(void)
+{
+	int i, res = 0;
+
+	mutex_lock(&ht_caches_lock);
+	if (ht_caches_users++ == 0) {
+		for (i = 0; i < ARRAY_SIZE(ht_item_sizes); i++) {
+			ht_item_caches[i] = kmem_cache_create(ht_item_cache_names[i],
+				ht_item_sizes[i], 0, SLAB_HWCACHE_ALIGN, NULL);
+			if (ht_item_caches[i] == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&ht_caches_lock);
+	return res;
+}
+
+int ht_init(struct ht *ht, unsigned int min_size, const char *hash_function,
+		unsigned int flags, const struct ht_ops *ops)
+{
+	struct ht_bucket_table *tbl;
+	unsigned int i;
+	int res;
+
+	memset(ht, 0, sizeof(*ht));
+	if ((res = ht_hash_init(ht, hash_function)) != 0)
+		return res;
+	if (ops != NULL)
+		ht->ops = *ops;
+	ht->ordered = flags & HT_ORDERED;
+	ht->open = flags & HT_OPEN;
+	spin_lock_init(&ht->index_lock);
+	ht->index = RB_ROOT;
+	mutex_init(&ht->resize_lock);
+	mutex_init(&ht->evict_lock);
+	INIT_WORK(&ht->resize_work, ht_resize_worker);
+	INIT_DELAYED_WORK(&ht->expire_work, ht_expire_worker);
+
+	ht->stats = alloc_percpu(struct ht_stats);
+	if (ht->stats == NULL)
+		return -ENOMEM;
+	if ((res = ht_create_caches()) != 0)
+		goto out_caches;
+	ht->min_bits = clamp_t(unsigned int, fls(min_size), 1, HT_MAX_BITS);
+	ht->lock_bits = min_t(unsigned int, ht->min_bits, HT_MAX_LOCK_BITS);
+	tbl = ht_alloc_table(ht, ht->min_bits, 0);
+	if (tbl == NULL) {
+		res = -ENOMEM;
+		goto out_caches;
+	}
+	ht->array_size = tbl->size;
+
+	ht->locks = kcalloc(1U << ht->lock_bits, sizeof(struct ht_lock), GFP_KERNEL);
+	if (ht->locks == NULL) {
+		kvfree(tbl);
+		res = -ENOMEM;
+		goto out_caches;
+	}
+	for (i = 0; i < (1U << ht->lock_bits); i++)
+		mutex_init(&ht->locks[i].lock);
+	RCU_INIT_POINTER(ht->table, tbl);
+	return 0;
+
+out_caches:
+	ht_destroy_caches();
+	free_percpu(ht->stats);
+	ht->stats = NULL;
+	return res;
+}
+
+static struct hlist_head *ht_bucket(struct ht_bucket_table *tbl, unsigned long hash)
+{
+	return &tbl->buckets[hash_long(hash, tbl->bits)];
+}
+
+static struct ht_item *ht_entry(struct hlist_node *node, unsigned int gen)
+{
+	return container_of(node - gen, struct ht_item, entry[0]);
+}
+
+#define ht_for_each_item_rcu(item, node, head, gen) \
+	for (node = rcu_dereference_raw(hlist_first_rcu(head)); \
+		node != NULL && ((item = ht_entry(node, gen)), true); \
+		node = rcu_dereference_raw(hlist_next_rcu(node)))
+
+// bucket index of the hash in a table of any size is the high bits of it
+static unsigned long ht_mix(unsigned long hash)
+{
+	return hash_long(hash, BITS_PER_LONG);
+}
+
+unsigned int ht_lock_index(struct ht *ht, unsigned long hash)
+{
+	return hash_long(hash, ht->lock_bits);
+}
+
+struct mutex *ht_bucket_lock(struct ht *ht, unsigned long hash)
+{
+	return &ht->locks[ht_lock_index(ht, hash)].lock;
+}
+
+// wait for all writers, which have not seen ht_write_locked or
+// the new bucket table yet
+static void ht_sync_writers(struct ht *ht)
+{
+	unsigned int i;
+
+	for (i = 0; i < (1U << ht->lock_bits); i++) {
+		mutex_lock(&ht->locks[i].lock);
+		mutex_unlock(&ht->locks[i].lock);
+	}
+}
+
+void ht_stat_inc(struct ht *ht, enum ht_stat stat)
+{
+	this_cpu_inc(ht->stats->ops[stat]);
+}
+
+unsigned long ht_stat_sum(struct ht *ht, enum ht_stat stat)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(ht->stats, cpu)->ops[stat];
+	return sum;
+}
+
+void ht_hist_sum(struct ht *ht, enum ht_hist hist, unsigned long slots[HT_HIST_SLOTS])
+{
+	int cpu, i;
+
+	memset(slots, 0, sizeof(unsigned long) * HT_HIST_SLOTS);
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < HT_HIST_SLOTS; i++)
+			slots[i] += per_cpu_ptr(ht->stats, cpu)->hist[hist][i];
+}
+
+static void ht_stat_time(struct ht *ht, enum ht_hist hist, u64 start)
+{
+	unsigned int slot = min_t(unsigned int, fls64(ktime_get_ns() - start),
+				HT_HIST_SLOTS - 1);
+
+	this_cpu_inc(ht->stats->hist[hist][slot]);
+}
+
+void ht_lock_bucket(struct ht *ht, struct mutex *lock)
+{
+	u64 start = ktime_get_ns();
+
+	mutex_lock(lock);
+	ht_stat_time(ht, HT_HIST_LOCK_WAIT, start);
+}
+
+static bool ht_item_expired(const struct ht_item *item, u64 now)
+{
+	return item->expires != 0 && now >= item->expires;
+}
+
+#define HT_BYTES(b) (~0UL / 0xff * (b))
+
+// 0x80 in every byte of tags equal to tag. Unlike the usual has-zero-byte
+// trick it is exact, so an empty slot is never reported by mistake
+static unsigned long ht_group_match(unsigned long tags, u8 tag)
+{
+	unsigned long x = tags ^ HT_BYTES(tag);
+
+	return ~(((x & HT_BYTES(0x7f)) + HT_BYTES(0x7f)) | x | HT_BYTES(0x7f));
+}
+
+static unsigned int ht_group_slot(unsigned long match)
+{
+	return __ffs(match) / 8;
+}
+
+static unsigned long ht_group_set(unsigned long tags, unsigned int slot, u8 tag)
+{
+	return (tags & ~(0xffUL << (slot * 8))) | ((unsigned long)tag << (slot * 8));
+}
+
+static u8 ht_group_tag(unsigned long hash)
+{
+	return HT_TAG_FULL | (hash & 0x7f);
+}
+
+// the group index is taken from the high bits of the hash like the stripe,
+// a probe goes linearly and wraps around within the groups of the stripe
+// (mask), so only the stripe lock holder changes them
+static unsigned long ht_group_first(struct ht *ht, struct ht_bucket_table *tbl,
+					unsigned long hash, unsigned long *mask)
+{
+	*mask = (1UL << (tbl->group_bits - ht->lock_bits)) - 1;
+	return hash_long(hash, tbl->group_bits);
+}
+
+static unsigned long ht_group_next(unsigned long group, unsigned long mask)
+{
+	return (group & ~mask) | ((group + 1) & mask);
+}
+
+// lookup of HT_OPEN tables: one word of tags filters the items of a group,
+// so an item is usually found with the group and the item itself read.
+// A probe ends at a group with an empty slot, see ht_group_del
+static struct ht_item *ht_group_find(struct ht *ht, struct ht_bucket_table *tbl,
+					const char *key, int size, unsigned long hash)
+{
+	unsigned long group, mask, n, tags, match;
+	struct ht_item *item;
+	u8 tag = ht_group_tag(hash);
+
+	group = ht_group_first(ht, tbl, hash, &mask);
+	for (n = 0; n <= mask; n++, group = ht_group_next(group, mask)) {
+		// the item of a tag is stored before the tag
+		tags = smp_load_acquire(&tbl->groups[group].tags);
+		for (match = ht_group_match(tags, tag); match != 0; match &= match - 1) {
+			item = rcu_dereference_raw(tbl->groups[group].items[ht_group_slot(match)]);
+			if (item->hash == hash && item->key_size == size &&
+				memcmp(item->key, key, size) == 0)
+				return item;
+		}
+		if (ht_group_match(tags, HT_TAG_EMPTY) != 0)
+			break;
+	}
+	return NULL;
+}
+
+// the functions below change the index of tbl, the bucket lock must be
+// held. They do nothing for chained tables
+
+// takes the first empty or deleted slot of the probe. If the groups of the
+// stripe are full, lookups of the stripe use the chains until a resize
+// replaces the table
+static void ht_group_add(struct ht *ht, struct ht_bucket_table *tbl,
+			struct ht_item *item)
+{
+	unsigned long group, mask, n, tags, free;
+	unsigned int slot;
+
+	if (tbl->groups == NULL)
+		return;
+	group = ht_group_first(ht, tbl, item->hash, &mask);
+	for (n = 0; n <= mask; n++, group = ht_group_next(group, mask)) {
+		tags = tbl->groups[group].tags;
+		free = ht_group_match(tags, HT_TAG_EMPTY) | ht_group_match(tags, HT_TAG_DELETED);
+		if (free != 0) {
+			slot = ht_group_slot(free);
+			rcu_assign_pointer(tbl->groups[group].items[slot], item);
+			smp_store_release(&tbl->groups[group].tags,
+				ht_group_set(tags, slot, ht_group_tag(item->hash)));
+			return;
+		}
+	}
+	set_bit(ht_lock_index(ht, item->hash), tbl->overflow);
+}
+
+// group and slot of item, NULL if it did not fit into the index
+static struct ht_group *ht_group_lookup(struct ht *ht, struct ht_bucket_table *tbl,
+					const struct ht_item *item, unsigned int *slot)
+{
+	unsigned long group, mask, n, tags, match;
+	u8 tag = ht_group_tag(item->hash);
+
+	group = ht_group_first(ht, tbl, item->hash, &mask);
+	for (n = 0; n <= mask; n++, group = ht_group_next(group, mask)) {
+		tags = tbl->groups[group].tags;
+		for (match = ht_group_match(tags, tag); match != 0; match &= match - 1) {
+			*slot = ht_group_slot(match);
+			if (rcu_dereference_protected(tbl->groups[group].items[*slot], true) == item)
+				return &tbl->groups[group];
+		}
+		if (ht_group_match(tags, HT_TAG_EMPTY) != 0)
+			break;
+	}
+	return NULL;
+}
+
+// a group with an empty slot has never been full, so no probe went past
+// it and the slot may become empty too. Otherwise it is marked deleted
+// to keep the probes going, until a resize drops such slots
+static void ht_group_del(struct ht *ht, struct ht_bucket_table *tbl,
+			const struct ht_item *item)
+{
+	struct ht_group *group;
+	unsigned int slot;
+	u8 tag;
+
+	if (tbl->groups == NULL)
+		return;
+	group = ht_group_lookup(ht, tbl, item, &slot);
+	if (group == NULL)
+		return;
+	tag = ht_group_match(group->tags, HT_TAG_EMPTY) != 0 ? HT_TAG_EMPTY : HT_TAG_DELETED;
+	WRITE_ONCE(group->tags, ht_group_set(group->tags, slot, tag));
+}
+
+// the same key, so the slot and the tag stay
+static void ht_group_replace(struct ht *ht, struct ht_bucket_table *tbl,
+				const struct ht_item *old, struct ht_item *new)
+{
+	struct ht_group *group;
+	unsigned int slot;
+
+	if (tbl->groups == NULL)
+		return;
+	group = ht_group_lookup(ht, tbl, old, &slot);
+	if (group != NULL)
+		rcu_assign_pointer(group->items[slot], new);
+	else
+		ht_group_add(ht, tbl, new);
+}
+
+// returns expired items too
+static struct ht_item *ht_find_any(struct ht *ht, const char *key, int size,
+					unsigned long hash)
+{
+	struct ht_bucket_table *tbl;
+	struct hlist_node *node;
+	struct ht_item *item;
+
+	tbl = rcu_dereference_check(ht->table, lockdep_is_held(ht_bucket_lock(ht, hash)));
+	if (tbl->groups != NULL && !test_bit(ht_lock_index(ht, hash), tbl->overflow))
+		return ht_group_find(ht, tbl, key, size, hash);
+	ht_for_each_item_rcu(item, node, ht_bucket(tbl, hash), tbl->gen) {
+		// the full hash is compared first, the key only on a match
+		if (item->hash == hash && item->key_size == size &&
+			memcmp(item->key, key, size) == 0)
+			return item;
+	}
+	return NULL;
+}
+
+// caller must hold either rcu_read_lock or the bucket lock
+struct ht_item *ht_find_item(struct ht *ht, const char *key, int size,
+			unsigned long hash)
+{
+	struct ht_item *item = ht_find_any(ht, key, size, hash);
+
+	if (item == NULL)
+		return NULL;
+	// the clock is read only for items with a TTL
+	if (item->expires != 0 && ht_item_expired(item, ktime_get_ns()))
+		return NULL;
+	// written only when it changes, hot items stay clean in cache
+	if (!READ_ONCE(item->referenced))
+		WRITE_ONCE(item->referenced, true);
+	return item;
+}
+
+// ht_find_item counted in the get statistics and the lookup histogram,
+// for callers which have the hash already
+struct ht_item *ht_lookup_hash(struct ht *ht, const char *key, int size,
+			unsigned long hash)
+{
+	struct ht_item *item;
+	u64 start = ktime_get_ns();
+
+	item = ht_find_item(ht, key, size, hash);
+	ht_stat_time(ht, HT_HIST_LOOKUP, start);
+	ht_stat_inc(ht, item != NULL ? HT_STAT_GET_HIT : HT_STAT_GET_MISS);
+	return item;
+}
+
+struct ht_item *ht_lookup(struct ht *ht, const char *key, int size)
+{
+	return ht_lookup_hash(ht, key, size, ht_hash(ht, key, size));
+}
+
+// bucket lock must be held. Returns the table to change and sets *mirror
+// to the table being filled by the resize worker if the item bucket is
+// already migrated there. future_table is read first: ht_resize clears it
+// only after publishing the new table, so a writer that sees it cleared
+// also sees the new table and never changes the old one alone
+static struct ht_bucket_table *ht_write_table(struct ht *ht, unsigned long hash,
+			struct ht_bucket_table **mirror)
+{
+	struct ht_bucket_table *tbl, *future;
+
+	future = smp_load_acquire(&ht->future_table);
+	tbl = rcu_dereference_protected(ht->table, true);
+	*mirror = NULL;
+	if (future != NULL && future != tbl &&
+		hash_long(hash, tbl->bits) < READ_ONCE(ht->migrated))
+		*mirror = future;
+	return tbl;
+}
+
+static unsigned int *ht_long_chain(struct ht_bucket_table *tbl, unsigned int length)
+{
+	unsigned int last = max_t(unsigned int, tbl->size, HT_LONG_CHAINS) - 1;
+
+	return &tbl->long_chains[min(length - (HT_CHAIN_SLOTS - 1), last)];
+}
+
+// a chain changes by one item, so when the last chain of the longest
+// length shrinks, it is the longest one
+static void ht_long_chain_add(struct ht_bucket_table *tbl, unsigned int old,
+				unsigned int length)
+{
+	spin_lock(&tbl->long_lock);
+	if (old >= HT_CHAIN_SLOTS - 1)
+		(*ht_long_chain(tbl, old))--;
+	if (length >= HT_CHAIN_SLOTS - 1)
+		(*ht_long_chain(tbl, length))++;
+	if (length > tbl->long_max ||
+		(old == tbl->long_max && *ht_long_chain(tbl, old) == 0))
+		WRITE_ONCE(tbl->long_max, length);
+	spin_unlock(&tbl->long_lock);
+}
+
+// bucket lock must be held. Small stripes share bitmap words, so the bits
+// are changed atomically
+static void ht_chain_add(struct ht_bucket_table *tbl, unsigned long hash, int delta)
+{
+	unsigned long bkt = hash_long(hash, tbl->bits);
+	unsigned int *length = &tbl->lengths[bkt];
+	unsigned int old = *length;
+
+	atomic_dec(&tbl->chains[min_t(unsigned int, *length, HT_CHAIN_SLOTS - 1)]);
+	WRITE_ONCE(*length, *length + delta);
+	atomic_inc(&tbl->chains[min_t(unsigned int, *length, HT_CHAIN_SLOTS - 1)]);
+	if (max(old, *length) >= HT_CHAIN_SLOTS - 1)
+		ht_long_chain_add(tbl, old, *length);
+	if (*length == 0)
+		clear_bit(bkt, tbl->occupied);
+	else if (*length == 1 && delta > 0)
+		set_bit(bkt, tbl->occupied);
+}
+
+static int ht_key_cmp(const char *a, int a_size, const char *b, int b_size)
+{
+	int res = 0;
+
+	if (a_size != 0 && b_size != 0)
+		res = memcmp(a, b, min(a_size, b_size));
+	return res != 0 ? res : a_size - b_size;
+}
+
+// ordered tables allocate the index node of an item in front of it, so
+// items of other tables do not pay for it
+static struct rb_node *ht_index_node(struct ht_item *item)
+{
+	return (struct rb_node *)item - 1;
+}
+
+static struct ht_item *ht_index_item(struct rb_node *node)
+{
+	return (struct ht_item *)(node + 1);
+}
+
+// index lock must be held. Keys are unique, so the item is never equal to
+// the ones in the index
+static void ht_index_insert(struct ht *ht, struct ht_item *item)
+{
+	struct rb_node **link = &ht->index.rb_node, *parent = NULL;
+	struct ht_item *pos;
+
+	while (*link != NULL) {
+		parent = *link;
+		pos = ht_index_item(parent);
+		if (ht_key_cmp(item->key, item->key_size, pos->key, pos->key_size) < 0)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(ht_index_node(item), parent, link);
+	rb_insert_color(ht_index_node(item), &ht->index);
+}
+
+static void ht_link_item(struct ht *ht, struct ht_item *item)
+{
+	struct ht_bucket_table *tbl, *future;
+
+	tbl = ht_write_table(ht, item->hash, &future);
+	hlist_add_head_rcu(&item->entry[tbl->gen], ht_bucket(tbl, item->hash));
+	ht_chain_add(tbl, item->hash, 1);
+	ht_group_add(ht, tbl, item);
+	if (future != NULL) {
+		hlist_add_head_rcu(&item->entry[future->gen],
+			ht_bucket(future, item->hash));
+		ht_chain_add(future, item->hash, 1);
+		ht_group_add(ht, future, item);
+	}
+	if (ht->ordered) {
+		spin_lock(&ht->index_lock);
+		ht_index_insert(ht, item);
+		spin_unlock(&ht->index_lock);
+	}
+}
+
+static void ht_replace_item(struct ht *ht, struct ht_item *old, struct ht_item *new)
+{
+	struct ht_bucket_table *tbl, *future;
+
+	tbl = ht_write_table(ht, old->hash, &future);
+	hlist_replace_rcu(&old->entry[tbl->gen], &new->entry[tbl->gen]);
+	ht_group_replace(ht, tbl, old, new);
+	if (future != NULL) {
+		hlist_replace_rcu(&old->entry[future->gen], &new->entry[future->gen]);
+		ht_group_replace(ht, future, old, new);
+	}
+	if (ht->ordered) {
+		spin_lock(&ht->index_lock);
+		rb_replace_node(ht_index_node(old), ht_index_node(new), &ht->index);
+		spin_unlock(&ht->index_lock);
+	}
+}
+
+static void ht_unlink_item(struct ht *ht, struct ht_item *item)
+{
+	struct ht_bucket_table *tbl, *future;
+
+	tbl = ht_write_table(ht, item->hash, &future);
+	hlist_del_rcu(&item->entry[tbl->gen]);
+	ht_chain_add(tbl, item->hash, -1);
+	ht_group_del(ht, tbl, item);
+	if (future != NULL) {
+		hlist_del_rcu(&item->entry[future->gen]);
+		ht_chain_add(future, item->hash, -1);
+		ht_group_del(ht, future, item);
+	}
+	if (ht->ordered) {
+		spin_lock(&ht->index_lock);
+		rb_erase(ht_index_node(item), &ht->index);
+		spin_unlock(&ht->index_lock);
+	}
+}
+
+static bool validate_key(const ko_test_node *node)
+{
+	int i;
+
+	for (i = 0; i < node->key_size; i++)
+		if (!isprint(node->key[i]))
+			return false;
+	return true;
+}
+
+// index of the smallest size class fitting size, or -1
+static int ht_item_cache(size_t size)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ht_item_sizes); i++)
+		if (size <= ht_item_sizes[i])
+			return i;
+	return -1;
+}
+
+// not derived from the value pointer: a separate value may happen to be
+// allocated right after the item
+static bool ht_value_inline(const struct ht_item *item)
+{
+	return item->value_inline;
+}
+
+// size of the object, with the index node in front of an indexed item
+static size_t ht_item_size(const struct ht_item *item)
+{
+	size_t size = sizeof(struct ht_item) + item->key_size;
+
+	if (item->indexed)
+		size += sizeof(struct rb_node);
+	if (ht_value_inline(item))
+		size += item->value_size;
+	return size;
+}
+
+// slab object and separately allocated value
+static size_t ht_item_bytes(const struct ht_item *item)
+{
+	size_t size = ht_item_size(item);
+	int cache = ht_item_cache(size);
+
+	if (cache >= 0)
+		size = ht_item_sizes[cache];
+	if (item->paged)
+		size += PAGE_ALIGN(item->value_size);
+	else if (!ht_value_inline(item))
+		size += item->value_size;
+	return size;
+}
+
+static void *ht_alloc_object(size_t size)
+{
+	int cache = ht_item_cache(size);
+
+	if (cache < 0)
+		return kmalloc(size, GFP_KERNEL);
+	return kmem_cache_alloc(ht_item_caches[cache], GFP_KERNEL);
+}
+
+static void ht_free_object(void *ptr, size_t size)
+{
+	int cache = ht_item_cache(size);
+
+	if (cache < 0)
+		kfree(ptr);
+	else
+		kmem_cache_free(ht_item_caches[cache], ptr);
+}
+
+// the value is stored inline if the item with it fits the largest size
+// class, so a lookup of a short value touches a single object. Large
+// values get pages of their own, zeroed up to the page end as the tail is
+// visible in a mapping
+static struct ht_item *ht_alloc_item(struct ht *ht, const ko_test_node *node,
+			unsigned long hash)
+{
+	unsigned int paged_min = READ_ONCE(ht_paged_value_min);
+	struct ht_item *item;
+	void *object;
+	size_t size;
+	bool inline_value, paged;
+
+	size = sizeof(struct ht_item) + node->key_size;
+	if (ht->ordered)
+		size += sizeof(struct rb_node);
+	paged = paged_min != 0 && node->value_size >= paged_min;
+	inline_value = !paged && (node->value_size == 0 ||
+		size + node->value_size <= ht_item_sizes[ARRAY_SIZE(ht_item_sizes) - 1]);
+	if (inline_value)
+		size += node->value_size;
+
+	object = ht_alloc_object(size);
+	if (object == NULL)
+		return NULL;
+	item = ht->ordered ? ht_index_item(object) : object;
+	item->key_size = node->key_size;
+	item->value_size = node->value_size;
+	item->value_inline = inline_value;
+	item->paged = paged;
+	item->indexed = ht->ordered;
+	if (inline_value)
+		item->value = item->key + node->key_size;
+	else {
+		if (paged)
+			item->value = vmalloc_user(node->value_size);
+		else
+			item->value = kvmalloc(node->value_size, GFP_KERNEL);
+		if (item->value == NULL) {
+			ht_free_object(object, size);
+			return NULL;
+		}
+	}
+	item->hash = hash;
+	item->expires = 0;
+	item->version = 0;
+	refcount_set(&item->ref, 1);
+	item->referenced = false;
+	item->priv = NULL;
+	memcpy(item->key, node->key, node->key_size);
+	memcpy(item->value, node->value, node->value_size);
+	return item;
+}
+
+static void ht_item_free_rcu(struct rcu_head *head)
+{
+	struct ht_item *item = container_of(head, struct ht_item, rcu);
+
+	if (item->paged)
+		vfree(item->value);
+	else if (!ht_value_inline(item))
+		kvfree(item->value);
+	ht_free_object(item->indexed ? (void *)ht_index_node(item) : item,
+		ht_item_size(item));
+}
+
+
+// caller must hold rcu_read_lock, fails if the item is already removed
+// and waits for its grace period
+bool ht_item_tryget(struct ht_item *item)
+{
+	return refcount_inc_not_zero(&item->ref);
+}
+
+// caller must already hold a reference
+void ht_item_get(struct ht_item *item)
+{
+	refcount_inc(&item->ref);
+}
+
+// the last reference may be dropped while RCU readers still walk
+// through the item, so it is freed after a grace period
+void ht_item_put(struct ht_item *item)
+{
+	if (refcount_dec_and_test(&item->ref))
+		call_rcu(&item->rcu, ht_item_free_rcu);
+}
+
+// returns the item with a reference taken, NULL if there is no such key.
+// The item stays valid without any lock until ht_item_put
+struct ht_item *ht_get_item(struct ht *ht, const char *key, int key_size)
+{
+	struct ht_item *item;
+
+	rcu_read_lock();
+	item = ht_lookup(ht, key, key_size);
+	if (item != NULL && !ht_item_tryget(item))
+		item = NULL;
+	rcu_read_unlock();
+	return item;
+}
+
+// bucket bits the table should have for the current item count, or 0 if
+// load factor is within limits
+static unsigned int ht_wanted_bits(struct ht *ht, unsigned int bits)
+{
+	u64 count = (u64)max_t(unsigned long, atomic_read(&ht->item_count),
+				READ_ONCE(ht->reserved)) * 100;
+	u64 load = READ_ONCE(ht_max_load_factor) ?: DEFAULT_MAX_LOAD_FACTOR;
+	unsigned int wanted;
+
+	if (count > (load << bits)) {
+		if (bits >= HT_MAX_BITS)
+			return 0;
+	} else if (count * 8 < (load << bits)) {
+		if (bits <= ht->min_bits)
+			return 0;
+	} else
+		return 0;
+
+	// resized table is filled by half of ht_max_load_factor
+	wanted = ht->min_bits;
+	while (wanted < HT_MAX_BITS && count * 2 > (load << wanted))
+		wanted++;
+	return wanted == bits ? 0 : wanted;
+}
+
+void ht_check_resize(struct ht *ht)
+{
+	if (ht_wanted_bits(ht, ilog2(READ_ONCE(ht->array_size))) != 0)
+		queue_work(system_unbound_wq, &ht->resize_work);
+}
+
+// copy all items of tbl into future bucket by bucket, the stripe lock of
+// the buckets is held only for HT_MIGRATE_CHUNK buckets at once
+static void ht_migrate(struct ht *ht, struct ht_bucket_table *tbl,
+			struct ht_bucket_table *future)
+{
+	unsigned int bkt, end, stripe_size;
+	struct hlist_node *node;
+	struct ht_item *item;
+	struct mutex *lock;
+
+	stripe_size = 1U << (tbl->bits - ht->lock_bits);
+	for (bkt = 0; bkt < tbl->size; ) {
+		lock = &ht->locks[bkt / stripe_size].lock;
+		end = min(bkt + HT_MIGRATE_CHUNK, (bkt / stripe_size + 1) * stripe_size);
+		mutex_lock(lock);
+		for (; bkt < end; bkt++) {
+			ht_for_each_item_rcu(item, node, &tbl->buckets[bkt], tbl->gen) {
+				hlist_add_head_rcu(&item->entry[future->gen],
+					ht_bucket(future, item->hash));
+				ht_chain_add(future, item->hash, 1);
+				ht_group_add(ht, future, item);
+			}
+		}
+		WRITE_ONCE(ht->migrated, bkt);
+		mutex_unlock(lock);
+		cond_resched();
+	}
+}
+
+// resize lock must be held
+static void ht_resize(struct ht *ht)
+{
+	struct ht_bucket_table *tbl, *future;
+	unsigned int bits;
+
+	// iterators in read mode keep pointers into the table,
+	// resize is repeated on ht_unlock_writes
+	if (atomic_read(&ht->write_locked))
+		return;
+
+	tbl = rcu_dereference_protected(ht->table, lockdep_is_held(&ht->resize_lock));
+	bits = ht_wanted_bits(ht, tbl->bits);
+	if (bits == 0)
+		return;
+	future = ht_alloc_table(ht, bits, tbl->gen ^ 1);
+	if (future == NULL) {
+		pr_err("failed to allocate %u buckets for resize\n", 1U << bits);
+		return;
+	}
+
+	WRITE_ONCE(ht->migrated, 0);
+	smp_store_release(&ht->future_table, future);
+	ht_migrate(ht, tbl, future);
+
+	// in this order, see ht_write_table
+	rcu_assign_pointer(ht->table, future);
+	smp_store_release(&ht->future_table, NULL);
+	WRITE_ONCE(ht->array_size, future->size);
+	// nobody may use the old table or its item nodes after that
+	ht_sync_writers(ht);
+	synchronize_rcu();
+	kvfree(tbl);
+	pr_debug("hash table resized to %u buckets\n", future->size);
+}
+
+static void ht_resize_worker(struct work_struct *work)
+{
+	struct ht *ht = container_of(work, struct ht, resize_work);
+
+	mutex_lock(&ht->resize_lock);
+	ht_resize(ht);
+	mutex_unlock(&ht->resize_lock);
+}
+
+// memory and TTL accounting of an item linked into (sign 1) or removed
+// from (sign -1) the table
+static void ht_account_item(struct ht *ht, const struct ht_item *item, int sign)
+{
+	atomic_long_add(sign * (long)ht_item_bytes(item), &ht->bytes);
+	if (item->expires != 0)
+		atomic_add(sign, &ht->ttl_items);
+}
+
+// bucket lock must be held. deferred is passed to ht->ops.unpublish
+static void ht_remove_item(struct ht *ht, struct ht_item *item, bool deferred)
+{
+	ht_unlink_item(ht, item);
+	if (ht->ops.unpublish != NULL)
+		ht->ops.unpublish(ht, item->priv, deferred);
+	ht_account_item(ht, item, -1);
+	ht_item_put(item);
+	atomic_dec(&ht->item_count);
+}
+
+// bucket lock must be held. An expired item found is removed, so writers
+// reclaim expired keys they touch without waiting for the sweep
+static struct ht_item *ht_find_locked(struct ht *ht, const char *key, int size,
+					unsigned long hash)
+{
+	struct ht_item *item = ht_find_any(ht, key, size, hash);
+
+	if (item != NULL && item->expires != 0 && ht_item_expired(item, ktime_get_ns())) {
+		ht_stat_inc(ht, HT_STAT_EXPIRE);
+		ht_remove_item(ht, item, false);
+		return NULL;
+	}
+	return item;
+}
+
+// bucket lock must be held, the key must not be in the table
+static void ht_insert_item(struct ht *ht, struct ht_item *item)
+{
+	// item must be fully initialized before it becomes visible to readers
+	ht_account_item(ht, item, 1);
+	ht_link_item(ht, item);
+	if (ht->ops.publish != NULL)
+		item->priv = ht->ops.publish(ht, item);
+	atomic_inc(&ht->item_count);
+}
+
+static void ht_expire_schedule(struct ht *ht)
+{
+	queue_delayed_work(system_unbound_wq, &ht->expire_work,
+		msecs_to_jiffies(HT_EXPIRE_PERIOD_MS / HT_EXPIRE_PARTS));
+}
+
+// bucket lock must be held
+static u64 ht_next_version(struct ht *ht, unsigned long hash)
+{
+	return ++ht->locks[ht_lock_index(ht, hash)].version;
+}
+
+// bucket lock must be held. Links a new item with the key and value of
+// node in place of old, or adds it if old is NULL. expires is absolute
+static int ht_store_locked(struct ht *ht, struct ht_item *old,
+			const ko_test_node *node, u64 expires, unsigned long hash,
+			u64 *version)
+{
+	struct ht_item *item;
+
+	item = ht_alloc_item(ht, node, hash);
+	if (item == NULL)
+		return -ENOMEM;
+	item->version = ht_next_version(ht, hash);
+	if (version != NULL)
+		*version = item->version;
+	if (expires != 0) {
+		item->expires = expires;
+		ht_expire_schedule(ht);
+	}
+
+	if (old != NULL) {
+		// item must be fully initialized before it becomes visible to readers
+		ht_account_item(ht, item, 1);
+		item->priv = old->priv;
+		item->referenced = true;
+		ht_replace_item(ht, old, item);
+		ht_account_item(ht, old, -1);
+		ht_item_put(old);
+		return 0;
+	}
+	ht_insert_item(ht, item);
+	return 0;
+}
+
+int ht_add_item_locked(struct ht *ht, const ko_test_node *node,
+			bool allow_replace, unsigned int ttl_ms, unsigned long hash)
+{
+	struct ht_item *old;
+	u64 expires = 0;
+	int res;
+
+	if (atomic_read_acquire(&ht->write_locked)) {
+		ht_stat_inc(ht, HT_STAT_EAGAIN);
+		return -EAGAIN;
+	}
+
+	old = ht_find_locked(ht, node->key, node->key_size, hash);
+	if (old != NULL && !allow_replace) {
+		ht_stat_inc(ht, HT_STAT_EEXIST);
+		return -EEXIST;
+	}
+	if (old == NULL && !validate_key(node))
+		return -EINVAL;
+	if (ttl_ms != 0)
+		expires = ktime_get_ns() + (u64)ttl_ms * NSEC_PER_MSEC;
+	res = ht_store_locked(ht, old, node, expires, hash, NULL);
+	if (res == 0)
+		ht_stat_inc(ht, allow_replace ? HT_STAT_SET : HT_STAT_ADD);
+	return res;
+}
+
+int ht_add_item(struct ht *ht, const ko_test_node *node, bool allow_replace,
+		unsigned int ttl_ms)
+{
+	unsigned long hash;
+	struct mutex *lock;
+	int res;
+
+	hash = ht_hash(ht, node->key, node->key_size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	res = ht_add_item_locked(ht, node, allow_replace, ttl_ms, hash);
+	mutex_unlock(lock);
+	if (res == 0) {
+		ht_check_resize(ht);
+		ht_check_budget(ht);
+	}
+	return res;
+}
+
+int ht_del_item_locked(struct ht *ht, const char *key, int size, unsigned long hash)
+{
+	struct ht_item *item;
+
+	if (atomic_read_acquire(&ht->write_locked)) {
+		ht_stat_inc(ht, HT_STAT_EAGAIN);
+		return -EAGAIN;
+	}
+
+	item = ht_find_locked(ht, key, size, hash);
+	if (item == NULL)
+		return -ENOENT;
+
+	ht_stat_inc(ht, HT_STAT_DEL);
+	ht_remove_item(ht, item, false);
+	return 0;
+}
+
+int ht_del_item(struct ht *ht, const char *key, int size)
+{
+	unsigned long hash;
+	struct mutex *lock;
+	int res;
+
+	hash = ht_hash(ht, key, size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	res = ht_del_item_locked(ht, key, size, hash);
+	mutex_unlock(lock);
+	if (res == 0)
+		ht_check_resize(ht);
+	return res;
+}
+
+// read-modify-write updates. Like ht_add_item they take the bucket lock
+// once, so the value read and the one written cannot be separated by
+// another writer. The new item keeps the expiry time of the old one.
+// *version gets the version of the new item
+
+// bucket lock must be held. *old is NULL if there is no such key
+static int ht_update_find(struct ht *ht, const char *key, int size,
+			unsigned long hash, struct ht_item **old)
+{
+	if (atomic_read_acquire(&ht->write_locked)) {
+		ht_stat_inc(ht, HT_STAT_EAGAIN);
+		return -EAGAIN;
+	}
+	*old = ht_find_locked(ht, key, size, hash);
+	return 0;
+}
+
+// bucket lock must be held
+static int ht_update_store(struct ht *ht, struct ht_item *old,
+			const ko_test_node *node, unsigned long hash, u64 *version)
+{
+	int res;
+
+	if (old == NULL && !validate_key(node))
+		return -EINVAL;
+	res = ht_store_locked(ht, old, node, old != NULL ? old->expires : 0,
+				hash, version);
+	if (res == 0)
+		ht_stat_inc(ht, HT_STAT_UPDATE);
+	return res;
+}
+
+static void ht_update_done(struct ht *ht, struct mutex *lock, int res)
+{
+	mutex_unlock(lock);
+	if (res == 0) {
+		ht_check_resize(ht);
+		ht_check_budget(ht);
+	}
+}
+
+// replaces the value of an existing key only if the item has version
+// *version (0 to not compare) and value expected (NULL to not compare).
+// Otherwise returns -ECANCELED and sets *version to the current one
+int ht_cas_item(struct ht *ht, const ko_test_node *node, const char *expected,
+		int expected_size, u64 *version)
+{
+	struct ht_item *old;
+	unsigned long hash;
+	struct mutex *lock;
+	int res;
+
+	hash = ht_hash(ht, node->key, node->key_size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	res = ht_update_find(ht, node->key, node->key_size, hash, &old);
+	if (res == 0 && old == NULL)
+		res = -ENOENT;
+	else if (res == 0 && ((*version != 0 && old->version != *version) ||
+		(expected != NULL && (old->value_size != expected_size ||
+			memcmp(old->value, expected, expected_size) != 0)))) {
+		*version = old->version;
+		ht_stat_inc(ht, HT_STAT_CAS_FAIL);
+		res = -ECANCELED;
+	} else if (res == 0)
+		res = ht_update_store(ht, old, node, hash, version);
+	ht_update_done(ht, lock, res);
+	return res;
+}
+
+// fits any s64 in decimal, a sign and a trailing newline
+#define HT_NUMBER_SIZE 24
+
+// the value is a decimal number, a missing key is added as 0 + delta.
+// Returns -EINVAL if the value is not a number, -ERANGE on overflow
+int ht_incr_item(struct ht *ht, const char *key, int key_size, s64 delta,
+		s64 *number, u64 *version)
+{
+	char buf[HT_NUMBER_SIZE];
+	ko_test_node node = { .key = (char *)key, .key_size = key_size, .value = buf };
+	struct ht_item *old;
+	unsigned long hash;
+	struct mutex *lock;
+	s64 value = 0;
+	int res;
+
+	hash = ht_hash(ht, key, key_size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	res = ht_update_find(ht, key, key_size, hash, &old);
+	if (res == 0 && old != NULL) {
+		if (old->value_size >= sizeof(buf))
+			res = -EINVAL;
+		else {
+			memcpy(buf, old->value, old->value_size);
+			buf[old->value_size] = 0;
+			res = kstrtoll(buf, 10, &value);
+		}
+	}
+	if (res == 0 && check_add_overflow(value, delta, &value))
+		res = -ERANGE;
+	if (res == 0) {
+		node.value_size = sprintf(buf, "%lld", (long long)value);
+		res = ht_update_store(ht, old, &node, hash, version);
+	}
+	if (res == 0)
+		*number = value;
+	ht_update_done(ht, lock, res);
+	return res;
+}
+
+// appends the value of node to the value of the key, a missing key is
+// added with it
+int ht_append_item(struct ht *ht, const ko_test_node *node, u64 *version)
+{
+	ko_test_node joined = *node;
+	struct ht_item *old;
+	unsigned long hash;
+	struct mutex *lock;
+	char *value = NULL;
+	int res;
+
+	hash = ht_hash(ht, node->key, node->key_size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	res = ht_update_find(ht, node->key, node->key_size, hash, &old);
+	if (res == 0 && old != NULL) {
+		if (old->value_size > INT_MAX - node->value_size)
+			res = -E2BIG;
+		else if ((value = kvmalloc(old->value_size + node->value_size,
+						GFP_KERNEL)) == NULL)
+			res = -ENOMEM;
+		else {
+			memcpy(value, old->value, old->value_size);
+			memcpy(value + old->value_size, node->value, node->value_size);
+			joined.value = value;
+			joined.value_size = old->value_size + node->value_size;
+		}
+	}
+	if (res == 0)
+		res = ht_update_store(ht, old, &joined, hash, version);
+	ht_update_done(ht, lock, res);
+	kvfree(value);
+	return res;
+}
+
+// bulk load: the table is resized once for count more items before they
+// are added, and is not shrunk until ht_load_end. One load at a time is
+// expected, a concurrent one only makes resizes less exact
+void ht_load_begin(struct ht *ht, unsigned long count)
+{
+	mutex_lock(&ht->resize_lock);
+	WRITE_ONCE(ht->reserved, ht_item_count(ht) + count);
+	ht_resize(ht);
+	mutex_unlock(&ht->resize_lock);
+}
+
+// a trusted item comes from a dump of a table: its key is valid and
+// unique in the image, so it is linked without looking the key up.
+// Otherwise it works as ht_add_item with replace
+int ht_load_item(struct ht *ht, const ko_test_node *node, bool trusted)
+{
+	struct ht_item *item;
+	unsigned long hash;
+	struct mutex *lock;
+	int res = 0;
+
+	if (!trusted)
+		return ht_add_item(ht, node, true, 0);
+	hash = ht_hash(ht, node->key, node->key_size);
+	lock = ht_bucket_lock(ht, hash);
+	ht_lock_bucket(ht, lock);
+	if (atomic_read_acquire(&ht->write_locked)) {
+		ht_stat_inc(ht, HT_STAT_EAGAIN);
+		res = -EAGAIN;
+	} else if ((item = ht_alloc_item(ht, node, hash)) == NULL)
+		res = -ENOMEM;
+	else {
+		ht_stat_inc(ht, HT_STAT_ADD);
+		item->version = ht_next_version(ht, hash);
+		ht_insert_item(ht, item);
+	}
+	mutex_unlock(lock);
+	if (res == 0) {
+		ht_check_resize(ht);
+		ht_check_budget(ht);
+	}
+	return res;
+}
+
+void ht_load_end(struct ht *ht)
+{
+	WRITE_ONCE(ht->reserved, 0);
+	ht_check_resize(ht);
+}
+
+// called on module unload only, no concurrent access is possible
+static void ht_del_items(struct ht *ht)
+{
+	struct ht_bucket_table *tbl;
+	struct hlist_node *node, *tmp;
+	unsigned int bkt;
+
+	tbl = rcu_dereference_protected(ht->table, true);
+	for (bkt = 0; bkt < tbl->size; bkt++) {
+		node = tbl->buckets[bkt].first;
+		while (node != NULL) {
+			struct ht_item *pos = ht_entry(node, tbl->gen);
+
+			tmp = node->next;
+			hlist_del_rcu(node);
+			if (ht->ops.unpublish != NULL)
+				ht->ops.unpublish(ht, pos->priv, false);
+			ht_item_put(pos);
+			node = tmp;
+		}
+	}
+	ht->index = RB_ROOT;
+	atomic_set(&ht->item_count, 0);
+	atomic_long_set(&ht->bytes, 0);
+	atomic_set(&ht->ttl_items, 0);
+}
+
+void ht_destroy(struct ht *ht)
+{
+	unsigned int i;
+
+	cancel_work_sync(&ht->resize_work);
+	cancel_delayed_work_sync(&ht->expire_work);
+	ht_del_items(ht);
+	// wait for pending ht_item_free_rcu callbacks before the module is gone
+	rcu_barrier();
+	kvfree(rcu_dereference_protected(ht->table, true));
+	RCU_INIT_POINTER(ht->table, NULL);
+	for (i = 0; i < (1U << ht->lock_bits); i++)
+		mutex_destroy(&ht->locks[i].lock);
+	kfree(ht->locks);
+	ht->locks = NULL;
+	ht_destroy_caches();
+	free_percpu(ht->stats);
+	ht->stats = NULL;
+}
+
+// CLOCK eviction, expired items go first. The hand visits buckets in ht_mix() order, so its
+// position stays valid across a resize, and holds one stripe lock for up
+// to HT_MIGRATE_CHUNK buckets. A referenced item gets a second chance,
+// others are removed until nr items are gone or the table takes at most
+// target bytes. Two full sweeps are enough to find every cold item.
+// Without may_block busy stripes are skipped and sysfs files are removed
+// later: the shrinker may run while the caller holds any of our locks
+static unsigned long ht_evict(struct ht *ht, unsigned long nr, unsigned long target,
+				bool may_block)
+{
+	struct ht_bucket_table *tbl;
+	struct hlist_node *node, *next;
+	struct ht_item *item;
+	struct mutex *lock;
+	unsigned long bkt, start, end, stripe_size, freed = 0, visited = 0, limit;
+	unsigned int stripe_shift = BITS_PER_LONG - ht->lock_bits;
+	u64 now = ktime_get_ns();
+
+	if (may_block)
+		mutex_lock(&ht->evict_lock);
+	else if (!mutex_trylock(&ht->evict_lock))
+		return 0;
+	// progress is counted in buckets of the largest table, so a resize
+	// during the sweep neither shortens nor stretches it
+	limit = 2UL << HT_MAX_BITS;
+	while (freed < nr && visited < limit &&
+		(unsigned long)atomic_long_read(&ht->bytes) > target) {
+		lock = &ht->locks[ht->clock_hand >> stripe_shift].lock;
+		if (may_block)
+			mutex_lock(lock);
+		else if (!mutex_trylock(lock)) {
+			ht->clock_hand = ((ht->clock_hand >> stripe_shift) + 1) << stripe_shift;
+			visited += 1UL << (HT_MAX_BITS - ht->lock_bits);
+			continue;
+		}
+		// iterators of locked read mode point to the items
+		if (atomic_read_acquire(&ht->write_locked)) {
+			mutex_unlock(lock);
+			break;
+		}
+		tbl = rcu_dereference_protected(ht->table, lockdep_is_held(lock));
+		bkt = ht->clock_hand >> (BITS_PER_LONG - tbl->bits);
+		stripe_size = 1UL << (tbl->bits - ht->lock_bits);
+		end = min(bkt + HT_MIGRATE_CHUNK, (bkt / stripe_size + 1) * stripe_size);
+		start = bkt;
+		// a chain cut short leaves the hand on its bucket
+		for (bkt = find_next_bit(tbl->occupied, end, bkt); bkt < end;
+			bkt = find_next_bit(tbl->occupied, end, bkt + 1)) {
+			for (node = tbl->buckets[bkt].first; node != NULL && freed < nr &&
+				(unsigned long)atomic_long_read(&ht->bytes) > target; node = next) {
+				next = node->next;
+				item = ht_entry(node, tbl->gen);
+				if (ht_item_expired(item, now)) {
+					ht_stat_inc(ht, HT_STAT_EXPIRE);
+					ht_remove_item(ht, item, !may_block);
+					freed++;
+				} else if (READ_ONCE(item->referenced))
+					WRITE_ONCE(item->referenced, false);
+				else {
+					ht_stat_inc(ht, HT_STAT_EVICT);
+					ht_remove_item(ht, item, !may_block);
+					freed++;
+				}
+			}
+			if (node != NULL)
+				break;
+		}
+		visited += (bkt - start) << (HT_MAX_BITS - tbl->bits);
+		ht->clock_hand = bkt == tbl->size ? 0 : bkt << (BITS_PER_LONG - tbl->bits);
+		mutex_unlock(lock);
+		if (may_block)
+			cond_resched();
+	}
+	mutex_unlock(&ht->evict_lock);
+	return freed;
+}
+
+// called by writers with no locks held. Evicts down to 15/16 of the
+// budget, so the sweep does not restart on every write
+void ht_check_budget(struct ht *ht)
+{
+	unsigned long max_bytes = READ_ONCE(ht_max_bytes);
+
+	if (max_bytes != 0 && (unsigned long)atomic_long_read(&ht->bytes) > max_bytes)
+		ht_evict(ht, ULONG_MAX, max_bytes - max_bytes / 16, true);
+}
+
+// for the shrinker, never sleeps on the table locks
+unsigned long ht_shrink(struct ht *ht, unsigned long nr)
+{
+	return ht_evict(ht, nr, 0, false);
+}
+
+unsigned long ht_memory_used(struct ht *ht)
+{
+	return atomic_long_read(&ht->bytes);
+}
+
+// removes expired items of up to nr buckets starting from *hand, the
+// ht_mix() value of the next bucket, and stops when the hand wraps to the
+// table start. Like ht_evict it holds one stripe lock at a time, so there
+// is never a pass over the whole table that stops writers
+static unsigned long ht_expire_range(struct ht *ht, unsigned long *hand, unsigned long nr)
+{
+	struct ht_bucket_table *tbl;
+	struct hlist_node *node, *next;
+	struct ht_item *item;
+	struct mutex *lock;
+	unsigned long bkt, start, end, stripe_size, freed = 0, visited = 0;
+	u64 now = ktime_get_ns();
+
+	while (visited < nr) {
+		lock = &ht->locks[*hand >> (BITS_PER_LONG - ht->lock_bits)].lock;
+		mutex_lock(lock);
+		// iterators of locked read mode point to the items
+		if (atomic_read_acquire(&ht->write_locked)) {
+			mutex_unlock(lock);
+			break;
+		}
+		tbl = rcu_dereference_protected(ht->table, lockdep_is_held(lock));
+		bkt = *hand >> (BITS_PER_LONG - tbl->bits);
+		stripe_size = 1UL << (tbl->bits - ht->lock_bits);
+		end = min(bkt + HT_MIGRATE_CHUNK, (bkt / stripe_size + 1) * stripe_size);
+		start = bkt;
+		for (bkt = find_next_bit(tbl->occupied, end, bkt); bkt < end;
+			bkt = find_next_bit(tbl->occupied, end, bkt + 1)) {
+			for (node = tbl->buckets[bkt].first; node != NULL; node = next) {
+				next = node->next;
+				item = ht_entry(node, tbl->gen);
+				if (ht_item_expired(item, now)) {
+					ht_stat_inc(ht, HT_STAT_EXPIRE);
+					ht_remove_item(ht, item, false);
+					freed++;
+				}
+			}
+		}
+		visited += end - start;
+		*hand = bkt == tbl->size ? 0 : bkt << (BITS_PER_LONG - tbl->bits);
+		mutex_unlock(lock);
+		cond_resched();
+		if (*hand == 0)
+			break;
+	}
+	return freed;
+}
+
+// while there are items with a TTL, every HT_EXPIRE_PERIOD_MS the sweep
+// visits all buckets in HT_EXPIRE_PARTS steps. Lookups never return
+// expired items, the sweep only gives their memory back
+static void ht_expire_worker(struct work_struct *work)
+{
+	struct ht *ht = container_of(to_delayed_work(work), struct ht, expire_work);
+
+	ht_expire_range(ht, &ht->expire_hand,
+		max_t(unsigned long, ht_bucket_count(ht) / HT_EXPIRE_PARTS, 1));
+	if (atomic_read(&ht->ttl_items) > 0)
+		ht_expire_schedule(ht);
+}
+
+// one full pass without waiting for the worker
+unsigned long ht_expire_all(struct ht *ht)
+{
+	unsigned long hand = 0;
+
+	return ht_expire_range(ht, &hand, ULONG_MAX);
+}
+
+// writers get -EAGAIN until ht_unlock_writes, so the table can be read
+// by ht_read_init / ht_read_next. Returns false if it is already locked
+bool ht_lock_writes(struct ht *ht)
+{
+	bool res;
+
+	// waits for a running resize to finish
+	mutex_lock(&ht->resize_lock);
+	res = atomic_cmpxchg(&ht->write_locked, 0, 1) == 0;
+	if (res)
+		ht_sync_writers(ht);
+	mutex_unlock(&ht->resize_lock);
+	return res;
+}
+
+void ht_unlock_writes(struct ht *ht)
+{
+	// reads of the iterators complete before writers see 0
+	atomic_set_release(&ht->write_locked, 0);
+	ht_check_resize(ht);
+}
+
+bool ht_writes_locked(struct ht *ht)
+{
+	return atomic_read(&ht->write_locked) != 0;
+}
+
+int ht_item_count(struct ht *ht)
+{
+	return atomic_read(&ht->item_count);
+}
+
+unsigned int ht_bucket_count(struct ht *ht)
+{
+	return READ_ONCE(ht->array_size);
+}
+
+// the longest chain is found from the distribution, chains which do not
+// fit it are tracked by the writers
+unsigned int ht_chain_max(struct ht *ht)
+{
+	struct ht_bucket_table *tbl;
+	unsigned int i, max = 0;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->table);
+	for (i = 0; i < HT_CHAIN_SLOTS; i++)
+		if (atomic_read(&tbl->chains[i]) > 0)
+			max = i;
+	if (max == HT_CHAIN_SLOTS - 1)
+		max = max_t(unsigned int, max, READ_ONCE(tbl->long_max));
+	rcu_read_unlock();
+	return max;
+}
+
+// copies the chain length distribution, returns the bucket count of the
+// same table
+unsigned int ht_chain_lengths(struct ht *ht, int chains[HT_CHAIN_SLOTS])
+{
+	struct ht_bucket_table *tbl;
+	unsigned int i, size;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->table);
+	for (i = 0; i < HT_CHAIN_SLOTS; i++)
+		chains[i] = atomic_read(&tbl->chains[i]);
+	size = tbl->size;
+	rcu_read_unlock();
+	return size;
+}
+
+// read mode iterators. The table is write locked and resize is not
+// running, so the items and the bucket table stay in place
+static struct ht_bucket_table *ht_read_table(struct ht *ht)
+{
+	return rcu_dereference_protected(ht->table, atomic_read(&ht->write_locked));
+}
+
+// first item, which has not expired, starting from node of bucket bkt.
+// Empty buckets are skipped by the occupancy bitmap, so a sparse table
+// is read in time of its items
+static struct ht_item *ht_read_from(struct ht *ht, struct hlist_node *node,
+					int bkt, int *bkt_in, struct ht_item **item_in)
+{
+	struct ht_bucket_table *tbl = ht_read_table(ht);
+	u64 now = ktime_get_ns();
+
+	for (;;) {
+		for (; node != NULL; node = node->next) {
+			if (!ht_item_expired(ht_entry(node, tbl->gen), now)) {
+				*bkt_in = bkt;
+				*item_in = ht_entry(node, tbl->gen);
+				return *item_in;
+			}
+		}
+		bkt = find_next_bit(tbl->occupied, tbl->size, bkt + 1);
+		if (bkt >= tbl->size)
+			break;
+		node = tbl->buckets[bkt].first;
+	}
+	*bkt_in = bkt;
+	*item_in = NULL;
+	return NULL;
+}
+
+struct ht_item *ht_read_init(struct ht *ht, int *bkt_in, struct ht_item **item_in)
+{
+	return ht_read_from(ht, NULL, -1, bkt_in, item_in);
+}
+
+struct ht_item *ht_read_next(struct ht *ht, int *bkt_in, struct ht_item **item_in)
+{
+	struct ht_bucket_table *tbl = ht_read_table(ht);
+
+	return ht_read_from(ht, (*item_in)->entry[tbl->gen].next, *bkt_in, bkt_in, item_in);
+}
+
+static size_t ht_put_record(char *dst, const struct ht_item *item)
+{
+	ko_test_record *rec = (ko_test_record *)dst;
+	size_t size, data_size;
+
+	data_size = sizeof(ko_test_record) + item->key_size + item->value_size;
+	size = KO_TEST_RECORD_SIZE(item->key_size, item->value_size);
+	rec->key_size = item->key_size;
+	rec->value_size = item->value_size;
+	memcpy(dst + sizeof(ko_test_record), item->key, item->key_size);
+	memcpy(dst + sizeof(ko_test_record) + item->key_size, item->value, item->value_size);
+	// buffer goes to user space as is
+	memset(dst + data_size, 0, size - data_size);
+	return size;
+}
+
+// scan read mode, does not block writers. Buckets are visited in the order
+// of ht_mix() values, which a resize keeps, so every item present during
+// the whole scan is returned exactly once. *pos is the ht_mix() value the
+// next bucket starts with. Records of up to HT_SCAN_MAX_BUCKETS non-empty
+// buckets are copied into buf, a bucket is never split. Empty buckets
+// are skipped by the occupancy bitmap, a bucket that is filled after the
+// bitmap is read holds only items added during the scan.
+// Returns the size needed for the next bucket if it does not fit into
+// the empty buffer, 0 otherwise
+#define HT_SCAN_MAX_BUCKETS 256
+
+size_t ht_scan(struct ht *ht, unsigned long *pos, bool *done, char *buf,
+		size_t size, size_t *used_out)
+{
+	struct ht_bucket_table *tbl;
+	struct hlist_node *node;
+	struct ht_item *item;
+	unsigned long bkt, start, next;
+	size_t used = 0, bucket_start, need, record_size;
+	unsigned int steps;
+	size_t res = 0;
+	u64 now = ktime_get_ns();
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->table);
+	for (steps = 0; !*done && steps < HT_SCAN_MAX_BUCKETS; steps++) {
+		start = *pos;
+		bkt = start >> (BITS_PER_LONG - tbl->bits);
+		next = find_next_bit(tbl->occupied, tbl->size, bkt);
+		if (next == tbl->size) {
+			*done = true;
+			break;
+		}
+		if (next != bkt) {
+			bkt = next;
+			start = bkt << (BITS_PER_LONG - tbl->bits);
+			*pos = start;
+		}
+		bucket_start = used;
+		need = 0;
+		ht_for_each_item_rcu(item, node, &tbl->buckets[bkt], tbl->gen) {
+			// returned before the table was shrunk
+			if (ht_mix(item->hash) < start || ht_item_expired(item, now))
+				continue;
+			record_size = KO_TEST_RECORD_SIZE(item->key_size, item->value_size);
+			need += record_size;
+			// once a record did not fit, only the size is counted
+			if (bucket_start + need <= size && used + record_size == bucket_start + need)
+				used += ht_put_record(buf + used, item);
+		}
+		if (need != used - bucket_start) {
+			used = bucket_start;
+			if (used == 0)
+				res = need;
+			break;
+		}
+		if (bkt + 1 == tbl->size)
+			*done = true;
+		else
+			*pos = (bkt + 1) << (BITS_PER_LONG - tbl->bits);
+	}
+	rcu_read_unlock();
+	*used_out = used;
+	return res;
+}
+
+// first item of the index with the key not less than key, or greater if
+// after is set
+static struct rb_node *ht_index_find(struct ht *ht, const char *key, int size,
+					bool after)
+{
+	struct rb_node *node = ht->index.rb_node, *res = NULL;
+	struct ht_item *item;
+	int cmp;
+
+	while (node != NULL) {
+		item = ht_index_item(node);
+		cmp = ht_key_cmp(item->key, item->key_size, key, size);
+		if (cmp > 0 || (cmp == 0 && !after)) {
+			res = node;
+			node = node->rb_left;
+		} else
+			node = node->rb_right;
+	}
+	return res;
+}
+
+static bool ht_range_end(const struct ht_range *range, const struct ht_item *item)
+{
+	if (range->to == NULL)
+		return false;
+	if (range->prefix)
+		return item->key_size < range->to_size ||
+			memcmp(item->key, range->to, range->to_size) != 0;
+	return ht_key_cmp(item->key, item->key_size, range->to, range->to_size) >= 0;
+}
+
+// ordered read of the table, the index must be on. Records of up to
+// HT_RANGE_MAX_ITEMS keys of the range are copied into buf in key order,
+// expired items are skipped. The items are only picked under the index
+// lock, writers take it too, and copied after it with references held.
+// The range then starts after the last key copied, so every item present
+// during the whole read is returned once, like by ht_scan. Sets
+// range->done at the end. Returns the size needed for the next record if
+// it does not fit into the empty buffer, -ENOMEM or 0
+#define HT_RANGE_MAX_ITEMS 256
+
+long ht_range_scan(struct ht *ht, struct ht_range *range, char *buf, size_t size,
+		size_t *used_out)
+{
+	struct rb_node *node = NULL;
+	struct ht_item *item, **items;
+	size_t used = 0, record_size;
+	unsigned int count = 0, i;
+	long res = 0;
+	u64 now = ktime_get_ns();
+	char *from;
+
+	*used_out = 0;
+	if (range->done)
+		return 0;
+	items = kmalloc_array(HT_RANGE_MAX_ITEMS, sizeof(*items), GFP_KERNEL);
+	if (items == NULL)
+		return -ENOMEM;
+	spin_lock(&ht->index_lock);
+	node = ht_index_find(ht, range->from, range->from_size, range->after);
+	for (; node != NULL && count < HT_RANGE_MAX_ITEMS; node = rb_next(node)) {
+		item = ht_index_item(node);
+		if (ht_range_end(range, item)) {
+			node = NULL;
+			break;
+		}
+		if (ht_item_expired(item, now))
+			continue;
+		record_size = KO_TEST_RECORD_SIZE(item->key_size, item->value_size);
+		if (record_size > size - used) {
+			if (used == 0)
+				res = record_size;
+			break;
+		}
+		// indexed items are linked, the table reference is still held
+		if (!ht_item_tryget(item))
+			continue;
+		items[count++] = item;
+		used += record_size;
+	}
+	spin_unlock(&ht->index_lock);
+
+	used = 0;
+	for (i = 0; i < count; i++)
+		used += ht_put_record(buf + used, items[i]);
+	if (node == NULL)
+		range->done = true;
+	else if (count != 0) {
+		item = items[count - 1];
+		from = kmalloc(item->key_size, GFP_KERNEL);
+		if (from == NULL)
+			res = -ENOMEM;
+		else {
+			memcpy(from, item->key, item->key_size);
+			kfree(range->from);
+			range->from = from;
+			range->from_size = item->key_size;
+			range->after = true;
+		}
+	}
+	for (i = 0; i < count; i++)
+		ht_item_put(items[i]);
+	kfree(items);
+	if (res == -ENOMEM)
+		return res;
+	*used_out = used;
+	return res;
+}
+
+void ht_range_free(struct ht_range *range)
+{
+	kfree(range->from);
+	kfree(range->to);
+	range->from = NULL;
+	range->to = NULL;
+}
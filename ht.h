@@ -0,0 +1,226 @@
+#ifndef HT_H
+#define HT_H
+
+// hash table core of the module. The same source is built in user space
+// for benchmarks and fuzzing, test/ht_user.h provides the kernel API then
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/siphash.h>
+#include <linux/workqueue.h>
+#else
+#include "ht_user.h"
+#endif
+#include "ko_test_ioctl.h"
+
+// items are never changed after they become visible to readers, an update
+// replaces the whole item. Small values are stored inline after the key,
+// see ht_alloc_item. The table holds one reference, readers may take more
+// to use the item out of the RCU read section
+struct ht_item {
+	// an item is linked into two bucket arrays at once while the table
+	// is resized, each array uses its own node (see ht_bucket_table.gen)
+	struct hlist_node entry[2];
+	unsigned long hash;
+	// ktime_get_ns() the item expires at, 0 if never. Expired items are
+	// not returned and are removed by writers or ht_expire_worker
+	u64 expires;
+	// grows with every change of the key, see ht_lock
+	u64 version;
+	int key_size;
+	int value_size;
+	refcount_t ref;
+	// set on lookup, cleared by the CLOCK hand, see ht_evict
+	bool referenced;
+	// the value is stored right after the key, see ht_alloc_item
+	bool value_inline;
+	// the value takes whole vmalloc_user pages of its own and may be
+	// mapped to user space, see ht_paged_value_min
+	bool paged;
+	// the item of an HT_ORDERED table, its node of ht.index is allocated
+	// right before it, see ht_index_node
+	bool indexed;
+	char *value;
+	// returned by ht_ops.publish, passed to the item replacing this one
+	void *priv;
+	struct rcu_head rcu;
+	char key[];
+};
+
+struct ht;
+
+// called under the bucket lock when a key is added to or deleted from
+// the table, the module publishes items in sysfs with them. unpublish
+// gets deferred set when it is called from the shrinker and must not
+// take locks that reclaim may wait for
+struct ht_ops {
+	void *(*publish)(struct ht *ht, const struct ht_item *item);
+	void (*unpublish)(struct ht *ht, void *priv, bool deferred);
+};
+
+struct ht_bucket_table;
+struct ht_lock;
+struct ht_stats;
+
+// one hash table, the module keeps one per device minor. Fields are
+// private to ht.c, the struct is here to be embedded by its users
+struct ht {
+	struct ht_ops ops;
+	bool use_djb2;
+	siphash_key_t hash_key;
+	atomic_t item_count;
+	// memory taken by the items linked into the table, see ht_item_bytes
+	atomic_long_t bytes;
+	// items with a TTL, the expire sweep runs while there are any
+	atomic_t ttl_items;
+	// set while the table is read in locked mode, writers get -EAGAIN
+	atomic_t write_locked;
+	// HT_ORDERED: all items are also kept in index in key order. The
+	// index lock is taken under a bucket lock or alone
+	bool ordered;
+	spinlock_t index_lock;
+	struct rb_root index;
+	// HT_OPEN: lookups use an open addressing index of hash fingerprints
+	// instead of walking the chains, see ht_group_find
+	bool open;
+
+	unsigned int array_size;
+	unsigned int min_bits;
+	struct ht_bucket_table __rcu *table;
+	// while resizing: the table items are migrated to and the count of
+	// already migrated buckets of table. Writers mirror changes of
+	// migrated buckets into future_table
+	struct ht_bucket_table *future_table;
+	unsigned int migrated;
+	unsigned int lock_bits;
+	struct ht_lock *locks;
+	struct mutex resize_lock;
+	// item count a bulk load will reach, the table is not shrunk below it
+	unsigned long reserved;
+	struct work_struct resize_work;
+
+	// CLOCK hand, the ht_mix() value of the next bucket to visit
+	struct mutex evict_lock;
+	unsigned long clock_hand;
+	// the same for the expire sweep, used by ht_expire_worker only
+	struct delayed_work expire_work;
+	unsigned long expire_hand;
+
+	struct ht_stats __percpu *stats;
+};
+
+// keys from from (after it if after is set) up to, not including, to in
+// the order of memcmp, a shorter key goes first. to may be NULL for no
+// limit, with prefix set the keys must start with to instead. Key buffers
+// are kmalloc'ed and owned by the range, see ht_range_scan
+struct ht_range {
+	char *from;
+	int from_size;
+	bool after;
+	char *to;
+	int to_size;
+	bool prefix;
+	bool done;
+};
+
+enum ht_stat {
+	HT_STAT_GET_HIT,
+	HT_STAT_GET_MISS,
+	HT_STAT_ADD,
+	HT_STAT_SET,
+	HT_STAT_DEL,
+	HT_STAT_EEXIST,
+	HT_STAT_EAGAIN,
+	HT_STAT_ENOSPC,
+	HT_STAT_EVICT,
+	HT_STAT_EXPIRE,
+	HT_STAT_UPDATE,
+	HT_STAT_CAS_FAIL,
+	HT_STAT_COUNT
+};
+
+enum ht_hist {
+	HT_HIST_LOOKUP,
+	HT_HIST_LOCK_WAIT,
+	HT_HIST_COUNT
+};
+
+// slot 0 counts 0 ns, slot n counts [2^(n-1), 2^n) ns, the last one
+// everything above
+#define HT_HIST_SLOTS 32
+#define HT_CHAIN_SLOTS 32
+
+// ht_init flags
+#define HT_ORDERED 1
+#define HT_OPEN 2
+
+extern unsigned int ht_max_load_factor;
+extern unsigned long ht_max_bytes;
+extern unsigned int ht_paged_value_min;
+
+int ht_init(struct ht *ht, unsigned int min_size, const char *hash_function,
+		unsigned int flags, const struct ht_ops *ops);
+void ht_destroy(struct ht *ht);
+
+unsigned long ht_hash(struct ht *ht, const char *key, int size);
+unsigned int ht_lock_index(struct ht *ht, unsigned long hash);
+struct mutex *ht_bucket_lock(struct ht *ht, unsigned long hash);
+void ht_lock_bucket(struct ht *ht, struct mutex *lock);
+
+struct ht_item *ht_find_item(struct ht *ht, const char *key, int size,
+			unsigned long hash);
+struct ht_item *ht_lookup_hash(struct ht *ht, const char *key, int size,
+			unsigned long hash);
+struct ht_item *ht_lookup(struct ht *ht, const char *key, int size);
+struct ht_item *ht_get_item(struct ht *ht, const char *key, int key_size);
+bool ht_item_tryget(struct ht_item *item);
+void ht_item_get(struct ht_item *item);
+void ht_item_put(struct ht_item *item);
+
+// ttl_ms is the time to live of the item, 0 if it never expires
+int ht_add_item_locked(struct ht *ht, const ko_test_node *node,
+			bool allow_replace, unsigned int ttl_ms, unsigned long hash);
+int ht_add_item(struct ht *ht, const ko_test_node *node, bool allow_replace,
+		unsigned int ttl_ms);
+int ht_del_item_locked(struct ht *ht, const char *key, int size, unsigned long hash);
+int ht_del_item(struct ht *ht, const char *key, int size);
+int ht_cas_item(struct ht *ht, const ko_test_node *node, const char *expected,
+		int expected_size, u64 *version);
+int ht_incr_item(struct ht *ht, const char *key, int key_size, s64 delta,
+		s64 *number, u64 *version);
+int ht_append_item(struct ht *ht, const ko_test_node *node, u64 *version);
+void ht_check_resize(struct ht *ht);
+void ht_load_begin(struct ht *ht, unsigned long count);
+int ht_load_item(struct ht *ht, const ko_test_node *node, bool trusted);
+void ht_load_end(struct ht *ht);
+void ht_check_budget(struct ht *ht);
+unsigned long ht_shrink(struct ht *ht, unsigned long nr);
+unsigned long ht_memory_used(struct ht *ht);
+unsigned long ht_expire_all(struct ht *ht);
+
+bool ht_lock_writes(struct ht *ht);
+void ht_unlock_writes(struct ht *ht);
+bool ht_writes_locked(struct ht *ht);
+struct ht_item *ht_read_init(struct ht *ht, int *bkt_in, struct ht_item **item_in);
+struct ht_item *ht_read_next(struct ht *ht, int *bkt_in, struct ht_item **item_in);
+size_t ht_scan(struct ht *ht, unsigned long *pos, bool *done, char *buf,
+		size_t size, size_t *used_out);
+long ht_range_scan(struct ht *ht, struct ht_range *range, char *buf, size_t size,
+		size_t *used_out);
+void ht_range_free(struct ht_range *range);
+
+int ht_item_count(struct ht *ht);
+unsigned int ht_bucket_count(struct ht *ht);
+unsigned int ht_chain_max(struct ht *ht);
+unsigned int ht_chain_lengths(struct ht *ht, int chains[HT_CHAIN_SLOTS]);
+void ht_stat_inc(struct ht *ht, enum ht_stat stat);
+unsigned long ht_stat_sum(struct ht *ht, enum ht_stat stat);
+void ht_hist_sum(struct ht *ht, enum ht_hist hist, unsigned long slots[HT_HIST_SLOTS]);
+
+#endif
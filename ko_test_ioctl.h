@@ -18,7 +18,95 @@ typedef struct
 	int value_size;
 } ko_test_node;
 
+// KO_TEST_IOCTL_ADD_TTL / SET_TTL work as ADD / SET, the item expires
+// ttl_ms milliseconds later (never if it is 0). Expired items are not
+// returned, their memory is reclaimed in the background
+
+typedef struct
+{
+	ko_test_node node;
+	unsigned int ttl_ms;
+} ko_test_ttl_node;
+
+// Read-modify-write of one key in a single syscall. Every change of a key
+// gives its item a new, larger version.
+// KO_TEST_IOCTL_GETV works as KO_TEST_IOCTL_GET and returns the version.
+// KO_TEST_IOCTL_CAS sets the value of an existing key only if its version
+// is version (0 to not compare) and its value is expected (NULL to not
+// compare), else fails with ECANCELED and returns the current version.
+// KO_TEST_IOCTL_INCR adds number to the decimal value of the key (0 if
+// there is no such key) and returns the result in number, EINVAL if the
+// value is not a number, ERANGE on overflow.
+// KO_TEST_IOCTL_APPEND appends node.value to the value of the key, adds
+// the key if it is missing.
+// All of them return the new version in version and keep the TTL
+
+typedef struct
+{
+	ko_test_node node;
+	char *expected;
+	int expected_size;
+	unsigned long long version;
+	long long number;
+} ko_test_update;
+
+// Batch of nodes for KO_TEST_IOCTL_MGET / MSET / MDEL, processed by one
+// syscall. results[i] receives 0 or negative errno for nodes[i]; for MGET
+// nodes[i].value_size is updated the same way as by KO_TEST_IOCTL_GET.
+// Keys and values of one batch may take up to KO_TEST_MAX_BATCH_DATA bytes
+
+typedef struct
+{
+	ko_test_node *nodes;
+	int *results;
+	unsigned int count;
+} ko_test_batch;
+
+// KO_TEST_IOCTL_READ_BULK fills buf with as many records as fit in size
+// bytes and sets used and count. Every record is ko_test_record followed by
+// key and value bytes, next record starts KO_TEST_RECORD_SIZE bytes later
+
+typedef struct
+{
+	unsigned int key_size;
+	unsigned int value_size;
+} ko_test_record;
+
+typedef struct
+{
+	void *buf;
+	unsigned int size;
+	unsigned int used;
+	unsigned int count;
+} ko_test_bulk;
+
+// KO_TEST_IOCTL_LOAD adds all records of buf, size bytes in the format of
+// KO_TEST_IOCTL_READ_BULK, so buffers read by it and written one after
+// another load back as is. Existing keys are replaced. With
+// KO_TEST_LOAD_TRUSTED keys are not checked and not looked up, the image
+// must come from a dump and the table must be empty (EBUSY otherwise) and
+// not written while it loads. count is the record count of the image, 0 if
+// not known, the table is sized for it in advance; on return it holds the
+// number of records added
+
+typedef struct
+{
+	void *buf;
+	unsigned long long size;
+	unsigned int count;
+	unsigned int flags;
+} ko_test_load;
+
+#define KO_TEST_LOAD_TRUSTED      1
+
+#define KO_TEST_RECORD_ALIGN      8
+#define KO_TEST_RECORD_SIZE(key_size, value_size) \
+	((sizeof(ko_test_record) + (key_size) + (value_size) + KO_TEST_RECORD_ALIGN - 1) & \
+		~(KO_TEST_RECORD_ALIGN - 1))
+
 #define KO_TEST_MAX_VERSION_SIZE  128
+#define KO_TEST_MAX_BATCH         1024
+#define KO_TEST_MAX_BATCH_DATA    (16 * 1024 * 1024)
 
 #define KO_TEST_IOCTL_MAGIC      'S'
 #define KO_TEST_IOCTL_VERSION    _IOR(KO_TEST_IOCTL_MAGIC, 0, char *)
@@ -32,6 +120,149 @@ typedef struct
 #define KO_TEST_IOCTL_READ_NEXT  _IOWR(KO_TEST_IOCTL_MAGIC, 7, ko_test_node *)
 #define KO_TEST_IOCTL_READ_END   _IO(KO_TEST_IOCTL_MAGIC, 8)
 
+#define KO_TEST_IOCTL_MGET       _IOWR(KO_TEST_IOCTL_MAGIC, 9, ko_test_batch *)
+#define KO_TEST_IOCTL_MSET       _IOW(KO_TEST_IOCTL_MAGIC, 10, ko_test_batch *)
+#define KO_TEST_IOCTL_MDEL       _IOW(KO_TEST_IOCTL_MAGIC, 11, ko_test_batch *)
+#define KO_TEST_IOCTL_READ_BULK  _IOWR(KO_TEST_IOCTL_MAGIC, 12, ko_test_bulk *)
+
+// KO_TEST_IOCTL_READ_BEGIN starts a scan, which does not block writers and
+// other readers: every item present during the whole scan is returned
+// once, items changed meanwhile may be returned or not.
+// KO_TEST_IOCTL_READ_BEGIN_LOCKED blocks table changes until
+// KO_TEST_IOCTL_READ_END, only one file may be in this mode
+#define KO_TEST_IOCTL_READ_BEGIN_LOCKED _IO(KO_TEST_IOCTL_MAGIC, 13)
+
+#define KO_TEST_IOCTL_ADD_TTL    _IOW(KO_TEST_IOCTL_MAGIC, 14, ko_test_ttl_node *)
+#define KO_TEST_IOCTL_SET_TTL    _IOW(KO_TEST_IOCTL_MAGIC, 15, ko_test_ttl_node *)
+#define KO_TEST_IOCTL_LOAD       _IOWR(KO_TEST_IOCTL_MAGIC, 16, ko_test_load *)
+#define KO_TEST_IOCTL_GETV       _IOWR(KO_TEST_IOCTL_MAGIC, 17, ko_test_update *)
+#define KO_TEST_IOCTL_CAS        _IOWR(KO_TEST_IOCTL_MAGIC, 18, ko_test_update *)
+#define KO_TEST_IOCTL_INCR       _IOWR(KO_TEST_IOCTL_MAGIC, 19, ko_test_update *)
+#define KO_TEST_IOCTL_APPEND     _IOWR(KO_TEST_IOCTL_MAGIC, 20, ko_test_update *)
+
+// KO_TEST_IOCTL_READ_BEGIN_RANGE starts a scan of the keys from start up
+// to, not including, end in key order: bytes are compared as by memcmp,
+// a key goes before the longer ones it starts. NULL start or end is no
+// limit. With KO_TEST_RANGE_PREFIX the keys starting with start are read,
+// end is not used. Records are read by KO_TEST_IOCTL_READ_NEXT / READ_BULK
+// as in KO_TEST_IOCTL_READ_BEGIN mode, with the same guarantees. The module
+// must be loaded with ordered_index=1, EOPNOTSUPP otherwise
+
+typedef struct
+{
+	char *start;
+	int start_size;
+	char *end;
+	int end_size;
+	unsigned int flags;
+} ko_test_range;
+
+#define KO_TEST_RANGE_PREFIX      1
+
+#define KO_TEST_IOCTL_READ_BEGIN_RANGE _IOW(KO_TEST_IOCTL_MAGIC, 21, ko_test_range *)
+
+// Submission and completion rings shared with the module, so a client
+// runs many operations with few or no syscalls. KO_TEST_IOCTL_RING_SETUP
+// creates the rings of the file: params.entries (a power of two up to
+// KO_TEST_RING_MAX_ENTRIES) slots in each ring and a data area of
+// params.data_size bytes (up to KO_TEST_MAX_BATCH_DATA), and returns the offsets of the parts and the
+// size to mmap at offset 0. A file has one ring set for its lifetime.
+//
+// The client writes a ko_test_sqe to the slot sq_tail & (entries - 1) and
+// increments sq_tail; the module consumes up to sq_head and writes one
+// ko_test_cqe per submission to cq_tail, the client consumes them up to
+// cq_head. Counters are free running. Keys, values to write and buffers
+// for GET are ranges of the data area given by offsets. Submissions are
+// taken only while the completion ring has room.
+// KO_TEST_IOCTL_RING_ENTER runs the pending submissions and returns their
+// number. With KO_TEST_RING_POLL a kernel worker polls the ring instead
+// and ENTER only wakes it up: the worker sleeps after a second without
+// progress (no submissions, or a full completion ring) and sets
+// KO_TEST_RING_NEED_WAKEUP in header flags then, the client reads flags
+// after a full barrier following the sq_tail store and after consuming
+// completions.
+// Writes never wait for a locked table, they complete with EAGAIN
+
+typedef struct
+{
+	unsigned int sq_head;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	unsigned int flags;
+} ko_test_ring_header;
+
+typedef struct
+{
+	unsigned char opcode;
+	unsigned char reserved[3];
+	// ADD and SET, 0 if the item never expires
+	unsigned int ttl_ms;
+	unsigned int key_offset;
+	unsigned int key_size;
+	// the value of ADD and SET or the buffer of GET
+	unsigned int value_offset;
+	unsigned int value_size;
+	// returned in the completion as is
+	unsigned long long user_data;
+} ko_test_sqe;
+
+typedef struct
+{
+	unsigned long long user_data;
+	// 0 or negative errno as returned by the ioctl of the same operation
+	int res;
+	// GET: size of the value, also with ENOSPC
+	unsigned int value_size;
+	// GET: version of the item
+	unsigned long long version;
+} ko_test_cqe;
+
+typedef struct
+{
+	unsigned int entries;
+	unsigned int data_size;
+	unsigned int flags;
+	unsigned int sq_offset;
+	unsigned int cq_offset;
+	unsigned int data_offset;
+	unsigned int size;
+} ko_test_ring_params;
+
+#define KO_TEST_RING_GET          1
+#define KO_TEST_RING_SET          2
+#define KO_TEST_RING_ADD          3
+#define KO_TEST_RING_DEL          4
+
+// params.flags
+#define KO_TEST_RING_POLL         1
+// header flags
+#define KO_TEST_RING_NEED_WAKEUP  1
+
+#define KO_TEST_RING_MAX_ENTRIES  4096
+
+#define KO_TEST_IOCTL_RING_SETUP  _IOWR(KO_TEST_IOCTL_MAGIC, 22, ko_test_ring_params *)
+#define KO_TEST_IOCTL_RING_ENTER  _IO(KO_TEST_IOCTL_MAGIC, 23)
+
+// KO_TEST_IOCTL_MAP_VALUE maps the value of the key read-only into the
+// caller's address space instead of copying it out. Only values of at
+// least paged_value_min (module parameter) bytes are kept in pages that can
+// be mapped, others fail with EOPNOTSUPP and are read with GET. A mapping
+// is a snapshot of one version: it keeps the value alive until
+// munmap(value, value_size), while a change of the key makes a new item
+typedef struct
+{
+	char *key;
+	int key_size;
+	// returned: the mapping and the size and version of the value
+	const char *value;
+	int value_size;
+	unsigned long long version;
+} ko_test_map;
+
+#define KO_TEST_IOCTL_MAP_VALUE   _IOWR(KO_TEST_IOCTL_MAGIC, 24, ko_test_map *)
+
 // if ioctl returns ENOSPC, key_size and value size contain required buffer sizes
+// (for KO_TEST_IOCTL_READ_BULK size contains the size of the next record)
 
 #endif // KO_TEST_IOCTL_H
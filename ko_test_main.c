@@ -0,0 +1,2172 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/shrinker.h>
+#include <linux/version.h>
+#include <linux/sched/signal.h>
+#include <linux/vmalloc.h>
+#include <linux/mman.h>
+#include <linux/math64.h>
+#include "ht.h"
+
+#define DEVICE_NAME "ko_test_device"
+#define CLASS_NAME  "ko_test_class"
+
+#undef  pr_fmt
+#define pr_fmt(fmt) DEVICE_NAME ": " fmt
+
+#define MAX_TABLES 64
+static unsigned int tables = 1;
+
+module_param(tables, uint, 0444);
+MODULE_PARM_DESC(tables, "Number of independent tables, one device minor each");
+
+#define DEFAULT_HASH_TABLE_SIZE 4096
+static unsigned int hash_table_size[MAX_TABLES] = { DEFAULT_HASH_TABLE_SIZE };
+static unsigned int hash_table_sizes;
+
+module_param_array(hash_table_size, uint, &hash_table_sizes, 0444);
+MODULE_PARM_DESC(hash_table_size, "Min size of hash table, one per table. "
+	"Tables past the list get the last size");
+
+module_param_named(max_load_factor, ht_max_load_factor, uint, 0644);
+MODULE_PARM_DESC(max_load_factor, "Items per 100 buckets, the table grows above it");
+
+module_param_named(max_bytes, ht_max_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_bytes, "Memory budget of items in bytes, 0 is unlimited. "
+	"If set, cold items are evicted above it and on memory pressure");
+
+module_param_named(paged_value_min, ht_paged_value_min, uint, 0644);
+MODULE_PARM_DESC(paged_value_min, "Values of at least this many bytes are kept "
+	"in pages that KO_TEST_IOCTL_MAP_VALUE maps, 0 disables it");
+
+static char *hash_function = "siphash";
+
+module_param(hash_function, charp, 0444);
+MODULE_PARM_DESC(hash_function, "Key hash function: siphash (seeded) or djb2");
+
+static bool ordered_index;
+
+module_param(ordered_index, bool, 0444);
+MODULE_PARM_DESC(ordered_index, "Keep keys of every table in order for "
+	"prefix and range reads (KO_TEST_IOCTL_READ_BEGIN_RANGE)");
+
+static char *backend = "chain";
+
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Lookup structure of every table: chain (bucket lists) "
+	"or open (open addressing over hash fingerprints)");
+
+static char *sysfs_items = "sync";
+
+module_param(sysfs_items, charp, 0444);
+MODULE_PARM_DESC(sysfs_items, "Files of items in sysfs: sync, async (from a workqueue) or off");
+
+// every table has its own device node, minor 0 keeps the name of the
+// single table the module used to have, others get the minor appended
+struct ko_table {
+	struct ht ht;
+	unsigned int minor;
+	struct device *device;
+	// blocking writers wait here while some file is in locked read mode
+	wait_queue_head_t write_wq;
+	struct kobject *sysfs_root_dir;
+	struct kobject *sysfs_items_dir;
+	struct kobject *sysfs_stats_dir;
+};
+
+static struct class *self_class;
+static int major_number;
+static struct ko_table *ko_tables;
+static ssize_t item_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf);
+static ssize_t item_store(struct kobject *kobj, struct kobj_attribute *attr,
+						const char *buf, size_t count);
+
+// rings of a file, see KO_TEST_IOCTL_RING_SETUP. mem is mapped by the
+// client, which may write anything there at any time: sq_head and cq_tail
+// are kept here and only published in the header, submissions are copied
+// before they are checked
+struct ko_ring {
+	struct ko_table *table;
+	void *mem;
+	size_t size;
+	ko_test_ring_header *header;
+	ko_test_sqe *sq;
+	ko_test_cqe *cq;
+	char *data;
+	unsigned int entries;
+	unsigned int data_size;
+	unsigned int sq_head;
+	unsigned int cq_tail;
+	// taken by RING_ENTER and the worker while they consume the ring
+	struct mutex lock;
+	// key and value of the running submission
+	char *scratch;
+	size_t scratch_size;
+	// KO_TEST_RING_POLL: work polls the ring until it is idle for
+	// RING_IDLE_MS after idle_since
+	bool poll;
+	unsigned long idle_since;
+	struct delayed_work work;
+};
+
+#define RING_HEADER_SIZE 64
+#define RING_IDLE_MS 1000
+
+struct file_data {
+	// table of the device minor
+	struct ko_table *table;
+	struct mutex lock;
+	// locked read mode: bucket and item of the cursor
+	bool locked;
+	int bucket;
+	struct ht_item *pos;
+	// scan read mode: records copied from the table, batch_pos is
+	// the next record to return
+	bool scan;
+	bool scan_done;
+	unsigned long scan_pos;
+	// the scan reads range in key order instead of the buckets
+	bool ranged;
+	struct ht_range range;
+	char *batch;
+	size_t batch_size;
+	size_t batch_used;
+	size_t batch_pos;
+	// set once by RING_SETUP, read without the lock
+	struct ko_ring *ring;
+	// MAP_VALUE: the item device_mmap maps for map_task, under lock
+	struct ht_item *map_item;
+	struct task_struct *map_task;
+};
+
+#define SCAN_BATCH_SIZE (16 * 1024)
+
+// sysfs file of an item, passed to the new item when the value is updated
+struct ht_sysfs_attr {
+	struct kobj_attribute attr;
+	struct ko_table *table;
+	// the attr waits in ht_publish_list (async mode or a delayed create),
+	// created and removed are the state the worker has made and the one it
+	// has to reach. queued and created change under ht_publish_lock
+	struct list_head pending;
+	bool queued;
+	bool created;
+	bool removed;
+	char name[];
+};
+
+enum {
+	HT_PUBLISH_OFF,
+	HT_PUBLISH_SYNC,
+	HT_PUBLISH_ASYNC,
+};
+
+// ht_init flags from the module parameters
+static unsigned int ht_flags;
+
+static int ht_flags_init(void)
+{
+	if (strcmp(backend, "open") == 0)
+		ht_flags = HT_OPEN;
+	else if (strcmp(backend, "chain") != 0) {
+		pr_err("unknown backend %s\n", backend);
+		return -EINVAL;
+	}
+	if (ordered_index)
+		ht_flags |= HT_ORDERED;
+	return 0;
+}
+
+static int ht_publish_mode;
+static LIST_HEAD(ht_publish_list);
+static DEFINE_SPINLOCK(ht_publish_lock);
+static void ht_publish_worker(struct work_struct *work);
+static DECLARE_WORK(ht_publish_work, ht_publish_worker);
+
+static int ht_publish_init(void)
+{
+	if (strcmp(sysfs_items, "sync") == 0)
+		ht_publish_mode = HT_PUBLISH_SYNC;
+	else if (strcmp(sysfs_items, "async") == 0)
+		ht_publish_mode = HT_PUBLISH_ASYNC;
+	else if (strcmp(sysfs_items, "off") == 0)
+		ht_publish_mode = HT_PUBLISH_OFF;
+	else {
+		pr_err("unknown sysfs_items %s\n", sysfs_items);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// the queue keeps the order of operations, so a file of a deleted key is
+// removed before the file of the same key added again is created
+static void ht_queue_attr(struct ht_sysfs_attr *attr, bool remove)
+{
+	spin_lock(&ht_publish_lock);
+	if (remove)
+		attr->removed = true;
+	if (!attr->queued) {
+		list_add_tail(&attr->pending, &ht_publish_list);
+		attr->queued = true;
+	}
+	spin_unlock(&ht_publish_lock);
+	queue_work(system_unbound_wq, &ht_publish_work);
+}
+
+static void ht_publish_worker(struct work_struct *work)
+{
+	struct ht_sysfs_attr *attr;
+	bool removed;
+
+	for (;;) {
+		spin_lock(&ht_publish_lock);
+		attr = list_first_entry_or_null(&ht_publish_list,
+						struct ht_sysfs_attr, pending);
+		if (attr != NULL) {
+			list_del(&attr->pending);
+			attr->queued = false;
+			removed = attr->removed;
+		}
+		spin_unlock(&ht_publish_lock);
+		if (attr == NULL)
+			break;
+
+		// attr is freed only here, after the item has dropped it
+		if (removed) {
+			if (attr->created)
+				sysfs_remove_file(attr->table->sysfs_items_dir,
+						&attr->attr.attr);
+			kfree(attr);
+		} else if (!attr->created) {
+			if (sysfs_create_file(attr->table->sysfs_items_dir,
+						&attr->attr.attr) == 0) {
+				spin_lock(&ht_publish_lock);
+				attr->created = true;
+				spin_unlock(&ht_publish_lock);
+			} else
+				pr_err("sysfs_create_file failed\n");
+		}
+		cond_resched();
+	}
+}
+
+// ht_ops.publish, bucket lock is held
+static void *ht_publish(struct ht *ht, const struct ht_item *item)
+{
+	struct ko_table *table = container_of(ht, struct ko_table, ht);
+	struct ht_sysfs_attr *attr;
+	int res;
+
+	if (ht_publish_mode == HT_PUBLISH_OFF)
+		return NULL;
+	attr = kmalloc(sizeof(struct ht_sysfs_attr) + item->key_size + 1, GFP_KERNEL);
+	if (attr == NULL)
+		return NULL;
+	memcpy(attr->name, item->key, item->key_size);
+	attr->name[item->key_size] = 0;
+	sysfs_attr_init(&attr->attr.attr);
+	attr->attr.attr.mode = 0600;
+	attr->attr.attr.name = attr->name;
+	attr->attr.store = item_store;
+	attr->attr.show = item_show;
+	attr->table = table;
+	attr->queued = false;
+	attr->created = false;
+	attr->removed = false;
+	if (ht_publish_mode == HT_PUBLISH_ASYNC) {
+		ht_queue_attr(attr, false);
+		return attr;
+	}
+	res = sysfs_create_file(table->sysfs_items_dir, &attr->attr.attr);
+	// the file of an evicted item with the same key is not removed yet,
+	// the queue creates the new one after that
+	if (res == -EEXIST) {
+		ht_queue_attr(attr, false);
+		return attr;
+	}
+	if (res != 0) {
+		pr_err("sysfs_create_file failed\n");
+		kfree(attr);
+		return NULL;
+	}
+	attr->created = true;
+	return attr;
+}
+
+static void ht_unpublish(struct ht *ht, void *priv, bool deferred)
+{
+	struct ht_sysfs_attr *attr = priv;
+	bool owned;
+
+	if (attr == NULL)
+		return;
+	// an attr the worker has not created yet may be in its hands, and the
+	// file of its name may belong to another item: the worker removes it
+	spin_lock(&ht_publish_lock);
+	owned = !attr->queued && attr->created;
+	spin_unlock(&ht_publish_lock);
+	if (ht_publish_mode == HT_PUBLISH_ASYNC || deferred || !owned) {
+		ht_queue_attr(attr, true);
+		return;
+	}
+	sysfs_remove_file(attr->table->sysfs_items_dir, &attr->attr.attr);
+	kfree(attr);
+}
+
+static const struct ht_ops ht_sysfs_ops = {
+	.publish = ht_publish,
+	.unpublish = ht_unpublish,
+};
+
+static ssize_t item_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	struct ko_table *table = container_of(attr, struct ht_sysfs_attr, attr)->table;
+	struct ht_item *item;
+	ssize_t res = -ENOENT;
+
+	rcu_read_lock();
+	item = ht_lookup(&table->ht, attr->attr.name, strlen(attr->attr.name));
+	if (item != NULL) {
+		res = min_t(int, item->value_size, PAGE_SIZE);
+		memcpy(buf, item->value, res);
+	}
+	rcu_read_unlock();
+
+	return res;
+}
+
+static ssize_t item_store(struct kobject *kobj, struct kobj_attribute *attr,
+						const char *buf, size_t count)
+{
+	struct ko_table *table = container_of(attr, struct ht_sysfs_attr, attr)->table;
+	ssize_t res;
+	ko_test_node node;
+
+	node.key = (char*)attr->attr.name;
+	node.key_size = strlen(attr->attr.name);
+	node.value = (char*)buf;
+	node.value_size = count;
+
+	if ((res = ht_add_item(&table->ht, &node, true, 0)) == 0)
+		res = count;
+	return res;
+}
+
+// files of data/ and data/stats/ are shared by all tables, the directory
+// tells the table
+static struct ht *kobj_table(struct kobject *kobj)
+{
+	unsigned int i;
+
+	for (i = 0; i < tables; i++)
+		if (ko_tables[i].sysfs_root_dir == kobj ||
+			ko_tables[i].sysfs_stats_dir == kobj)
+			break;
+	return &ko_tables[i].ht;
+}
+
+static bool read_key_value(const char *buf, size_t count, ko_test_node *node)
+{
+	const char *end = buf + count;
+
+	node->key = (char*)buf;
+	while (buf != end)
+	if (*buf++ == '\n') {
+		node->key_size = buf - node->key - 1;
+		node->value = (char*)buf;
+		node->value_size = end - buf;
+		return true;
+	}
+	return false;
+}
+
+static ssize_t add_set_store(struct kobject *kobj, struct kobj_attribute *attr,
+						const char *buf, size_t count)
+{
+	ssize_t res;
+	bool allow_replace;
+	ko_test_node node;
+
+	if (!read_key_value(buf, count, &node))
+		return -ENOENT;
+	allow_replace = attr->attr.name[0] == 's';
+	if ((res = ht_add_item(kobj_table(kobj), &node, allow_replace, 0)) == 0)
+		res = count;
+	return res;
+}
+
+static struct kobj_attribute set_attr = {
+	.attr = {
+		.name = "set",
+		.mode = 0200
+	},
+	.store = add_set_store,
+};
+
+static struct kobj_attribute add_attr = {
+	.attr = {
+		.name = "add",
+		.mode = 0200
+	},
+	.store = add_set_store,
+};
+
+static ssize_t delete_store(struct kobject *kobj, struct kobj_attribute *attr,
+						 const char *buf, size_t count)
+{
+	ssize_t res = -ENOENT;
+
+	if (ht_del_item(kobj_table(kobj), buf, count) == 0)
+		res = count;
+	return res;
+}
+
+static struct kobj_attribute delete_attr = {
+	.attr = {
+		.name = "delete",
+		.mode = 0200
+	},
+	.store = delete_store,
+};
+
+static ssize_t locked_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	return sprintf(buf, "%s\n", ht_writes_locked(kobj_table(kobj)) ? "1" : "0");
+}
+
+static struct kobj_attribute locked_attr = {
+	.attr = {
+		.name = "locked",
+		.mode = 0400
+	},
+	.show = locked_show,
+};
+
+static ssize_t collision_counter_show(struct kobject *kobj, 
+		struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ht_chain_max(kobj_table(kobj)));
+}
+
+static struct kobj_attribute collision_counter_attr = {
+	.attr = {
+		.name = "collision_counter",
+		.mode = 0400
+	},
+	.show = collision_counter_show,
+};
+
+// one line per chain length up to the longest one: length and the
+// number of buckets
+static ssize_t chain_lengths_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	int chains[HT_CHAIN_SLOTS];
+	ssize_t res = 0;
+	int i, last = 0;
+
+	ht_chain_lengths(kobj_table(kobj), chains);
+	for (i = 0; i < HT_CHAIN_SLOTS; i++)
+		if (chains[i] > 0)
+			last = i;
+	for (i = 0; i <= last; i++)
+		res += sprintf(buf + res, "%d%s %d\n", i,
+			i == HT_CHAIN_SLOTS - 1 ? "+" : "", chains[i]);
+	return res;
+}
+
+static struct kobj_attribute chain_lengths_attr = {
+	.attr = {
+		.name = "chain_lengths",
+		.mode = 0400
+	},
+	.show = chain_lengths_show,
+};
+
+// mean length of non-empty chains
+static ssize_t chain_mean_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	struct ht *ht = kobj_table(kobj);
+	int chains[HT_CHAIN_SLOTS];
+	unsigned long used, mean = 0;
+
+	used = ht_chain_lengths(ht, chains) - chains[0];
+	if (used != 0)
+		mean = (unsigned long)ht_item_count(ht) * 100 / used;
+	return sprintf(buf, "%lu.%02lu\n", mean / 100, mean % 100);
+}
+
+static struct kobj_attribute chain_mean_attr = {
+	.attr = {
+		.name = "chain_mean",
+		.mode = 0400
+	},
+	.show = chain_mean_show,
+};
+
+static ssize_t bucket_count_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ht_bucket_count(kobj_table(kobj)));
+}
+
+static struct kobj_attribute bucket_count_attr = {
+	.attr = {
+		.name = "bucket_count",
+		.mode = 0400
+	},
+	.show = bucket_count_show,
+};
+
+static ssize_t load_factor_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	struct ht *ht = kobj_table(kobj);
+	unsigned long load;
+
+	load = (unsigned long)ht_item_count(ht) * 100 / ht_bucket_count(ht);
+	return sprintf(buf, "%lu.%02lu\n", load / 100, load % 100);
+}
+
+static struct kobj_attribute load_factor_attr = {
+	.attr = {
+		.name = "load_factor",
+		.mode = 0400
+	},
+	.show = load_factor_show,
+};
+
+static ssize_t memory_used_show(struct kobject *kobj,
+		struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", ht_memory_used(kobj_table(kobj)));
+}
+
+static struct kobj_attribute memory_used_attr = {
+	.attr = {
+		.name = "memory_used",
+		.mode = 0400
+	},
+	.show = memory_used_show,
+};
+
+static const char *const ht_stat_names[HT_STAT_COUNT] = {
+	"get_hit", "get_miss", "add", "set", "del", "eexist", "eagain", "enospc",
+	"evict", "expire", "update", "cas_fail",
+};
+
+static ssize_t ops_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	ssize_t res = 0;
+	int i;
+
+	for (i = 0; i < HT_STAT_COUNT; i++)
+		res += sprintf(buf + res, "%s %lu\n", ht_stat_names[i],
+				ht_stat_sum(kobj_table(kobj), i));
+	return res;
+}
+
+// one line per slot up to the last non-empty one: upper bound in ns
+// and the number of samples
+static ssize_t hist_show(struct ht *ht, enum ht_hist hist, char *buf)
+{
+	unsigned long slots[HT_HIST_SLOTS];
+	ssize_t res = 0;
+	int i, last = 0;
+
+	ht_hist_sum(ht, hist, slots);
+	for (i = 0; i < HT_HIST_SLOTS; i++)
+		if (slots[i] != 0)
+			last = i;
+	for (i = 0; i <= last; i++)
+		res += sprintf(buf + res, "%llu %lu\n", 1ULL << i, slots[i]);
+	return res;
+}
+
+static ssize_t lookup_ns_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	return hist_show(kobj_table(kobj), HT_HIST_LOOKUP, buf);
+}
+
+static ssize_t lock_wait_ns_show(struct kobject *kobj, struct kobj_attribute *attr,
+						char *buf)
+{
+	return hist_show(kobj_table(kobj), HT_HIST_LOCK_WAIT, buf);
+}
+
+static struct kobj_attribute ops_attr = {
+	.attr = {
+		.name = "ops",
+		.mode = 0444
+	},
+	.show = ops_show,
+};
+
+static struct kobj_attribute lookup_ns_attr = {
+	.attr = {
+		.name = "lookup_ns",
+		.mode = 0444
+	},
+	.show = lookup_ns_show,
+};
+
+static struct kobj_attribute lock_wait_ns_attr = {
+	.attr = {
+		.name = "lock_wait_ns",
+		.mode = 0444
+	},
+	.show = lock_wait_ns_show,
+};
+
+static struct kobj_attribute *sysfs_stats_files[] = {
+	&ops_attr,
+	&lookup_ns_attr,
+	&lock_wait_ns_attr,
+};
+
+static struct kobj_attribute *sysfs_root_files[] = {
+	&delete_attr,
+	&add_attr,
+	&set_attr,
+	&locked_attr,
+	&collision_counter_attr,
+	&chain_lengths_attr,
+	&chain_mean_attr,
+	&bucket_count_attr,
+	&load_factor_attr,
+	&memory_used_attr,
+};
+
+static int init_sysfs(struct ko_table *table)
+{
+	int res, i;
+
+	table->sysfs_root_dir = kobject_create_and_add("data", &table->device->kobj);
+	if (!table->sysfs_root_dir)
+		return -ENOMEM;
+
+	table->sysfs_items_dir = kobject_create_and_add("items", table->sysfs_root_dir);
+	if (!table->sysfs_items_dir)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(sysfs_root_files); i++) {
+		res = sysfs_create_file(table->sysfs_root_dir, &sysfs_root_files[i]->attr);
+		if (res != 0) {
+			pr_err("sysfs_create_file for %s failed\n",
+				sysfs_root_files[i]->attr.name);
+			return res;
+		}
+	}
+
+	table->sysfs_stats_dir = kobject_create_and_add("stats", table->sysfs_root_dir);
+	if (!table->sysfs_stats_dir)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(sysfs_stats_files); i++) {
+		res = sysfs_create_file(table->sysfs_stats_dir, &sysfs_stats_files[i]->attr);
+		if (res != 0) {
+			pr_err("sysfs_create_file for %s failed\n",
+				sysfs_stats_files[i]->attr.name);
+			return res;
+		}
+	}
+	return 0;
+}
+
+// also cleans up after a failed init_sysfs
+static void destroy_sysfs(struct ko_table *table)
+{
+	int i;
+
+	if (table->sysfs_stats_dir != NULL)
+		for (i = 0; i < ARRAY_SIZE(sysfs_stats_files); i++)
+			sysfs_remove_file(table->sysfs_stats_dir,
+				&sysfs_stats_files[i]->attr);
+	if (table->sysfs_root_dir != NULL)
+		for (i = 0; i < ARRAY_SIZE(sysfs_root_files); i++)
+			sysfs_remove_file(table->sysfs_root_dir,
+				&sysfs_root_files[i]->attr);
+
+	kobject_put(table->sysfs_stats_dir);
+	kobject_put(table->sysfs_items_dir);
+	kobject_put(table->sysfs_root_dir);
+}
+
+// the table gives memory back only in cache mode, when max_bytes is set
+static unsigned long ht_shrink_count(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	unsigned int i;
+
+	if (READ_ONCE(ht_max_bytes) == 0)
+		return 0;
+	for (i = 0; i < tables; i++)
+		count += ht_item_count(&ko_tables[i].ht);
+	return count;
+}
+
+// every call starts from the next table, so the pressure is spread
+// over all of them
+static unsigned long ht_shrink_scan(struct shrinker *shrinker,
+					struct shrink_control *sc)
+{
+	static atomic_t next_table = ATOMIC_INIT(0);
+	unsigned long freed = 0;
+	unsigned int i, start;
+
+	if (READ_ONCE(ht_max_bytes) == 0)
+		return SHRINK_STOP;
+	start = (unsigned int)atomic_inc_return(&next_table) % tables;
+	for (i = 0; i < tables && freed < sc->nr_to_scan; i++)
+		freed += ht_shrink(&ko_tables[(start + i) % tables].ht,
+				sc->nr_to_scan - freed);
+	return freed != 0 ? freed : SHRINK_STOP;
+}
+
+// register_shrinker() is gone since 6.7, shrinkers are allocated by the core
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static struct shrinker *ht_shrinker;
+
+static int register_ht_shrinker(void)
+{
+	ht_shrinker = shrinker_alloc(0, "ko_test");
+	if (ht_shrinker == NULL)
+		return -ENOMEM;
+	ht_shrinker->count_objects = ht_shrink_count;
+	ht_shrinker->scan_objects = ht_shrink_scan;
+	ht_shrinker->seeks = DEFAULT_SEEKS;
+	shrinker_register(ht_shrinker);
+	return 0;
+}
+
+static void unregister_ht_shrinker(void)
+{
+	shrinker_free(ht_shrinker);
+}
+#else
+static struct shrinker ht_shrinker = {
+	.count_objects = ht_shrink_count,
+	.scan_objects = ht_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static int register_ht_shrinker(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	return register_shrinker(&ht_shrinker, "ko_test");
+#else
+	return register_shrinker(&ht_shrinker);
+#endif
+}
+
+static void unregister_ht_shrinker(void)
+{
+	unregister_shrinker(&ht_shrinker);
+}
+#endif
+
+static int device_open(struct inode *, struct file *);
+static int device_release(struct inode *, struct file *);
+static long device_unlocked_ioctl(struct file *, unsigned int, unsigned long);
+static __poll_t device_poll(struct file *, poll_table *);
+static int device_mmap(struct file *, struct vm_area_struct *);
+
+static struct file_operations file_ops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = device_unlocked_ioctl,
+	.poll = device_poll,
+	.mmap = device_mmap,
+	.open = device_open,
+	.release = device_release
+};
+
+static int load_key_value_user(ko_test_node *node, void __user *arg_user)
+{
+	char *ptr;
+
+	if (copy_from_user(node, arg_user, sizeof(ko_test_node)) != 0)
+		return -EFAULT;
+	if (node->key_size <= 0 || node->key == NULL || node->value_size < 0)
+		return -EINVAL;
+	if ((ptr = kmalloc(node->key_size, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if (copy_from_user(ptr, node->key, node->key_size) != 0) {
+		kfree(ptr);
+		return -EFAULT;
+	}
+	node->key = ptr;
+
+	if (node->value != NULL) {
+		if ((ptr = kmalloc(node->value_size, GFP_KERNEL)) == NULL) {
+			kfree(node->key);
+			return -ENOMEM;
+		}
+		if (copy_from_user(ptr, node->value, node->value_size) != 0) {
+			kfree(node->key);
+			kfree(ptr);
+			return -EFAULT;
+		}
+		node->value = ptr;
+	}
+	return 0;
+}
+
+static int load_key_user(char **key, const ko_test_node *node)
+{
+	char *ptr;
+
+	if (node->key_size <= 0 || node->key == NULL || node->value_size < 0)
+		return -EINVAL;
+	if ((ptr = kmalloc(node->key_size, GFP_KERNEL)) == NULL)
+		return -ENOMEM;
+	if (copy_from_user(ptr, node->key, node->key_size) != 0) {
+		kfree(ptr);
+		return -EFAULT;
+	}
+	*key = ptr;
+	return 0;
+}
+
+struct batch_entry {
+	// key and value point into the batch data buffer
+	ko_test_node node;
+	unsigned long hash;
+	// ht_lock_index of the hash
+	unsigned int stripe;
+	unsigned int index;
+	int result;
+	// not processed yet or got -EAGAIN
+	bool pending;
+	// referenced item found by MGET
+	struct ht_item *item;
+};
+
+// entries are grouped by lock stripe, the order of operations on the same
+// key is kept
+static int batch_entry_cmp(const void *a, const void *b)
+{
+	const struct batch_entry *ea = a, *eb = b;
+
+	if (ea->stripe != eb->stripe)
+		return ea->stripe < eb->stripe ? -1 : 1;
+	return ea->index < eb->index ? -1 : 1;
+}
+
+// copies keys (and values if with_values is set) of all batch nodes into
+// one buffer. Invalid nodes are not loaded and get their result set
+static int load_batch_user(struct ht *ht, const ko_test_node *nodes,
+			unsigned int count, bool with_values,
+			struct batch_entry *entries, char **data_out)
+{
+	struct batch_entry *e;
+	size_t total = 0, value_size;
+	unsigned int i;
+	char *data;
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		e->node = nodes[i];
+		e->index = i;
+		e->result = 0;
+		e->pending = false;
+		// rejected entries are sorted too, by these
+		e->hash = 0;
+		e->stripe = 0;
+		if (e->node.key_size <= 0 || e->node.key == NULL || e->node.value_size < 0) {
+			e->result = -EINVAL;
+			continue;
+		}
+		// without values node.value_size keeps the user buffer size
+		if (with_values && e->node.value == NULL)
+			e->node.value_size = 0;
+		total += e->node.key_size;
+		if (with_values)
+			total += e->node.value_size;
+		if (total > KO_TEST_MAX_BATCH_DATA)
+			return -E2BIG;
+	}
+
+	data = kvmalloc(total, GFP_KERNEL);
+	if (data == NULL)
+		return -ENOMEM;
+	*data_out = data;
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		if (e->result != 0)
+			continue;
+		value_size = with_values ? e->node.value_size : 0;
+		if (copy_from_user(data, nodes[i].key, e->node.key_size) != 0 ||
+			copy_from_user(data + e->node.key_size, nodes[i].value,
+					value_size) != 0) {
+			e->result = -EFAULT;
+			continue;
+		}
+		e->node.key = data;
+		e->node.value = with_values ? data + e->node.key_size : NULL;
+		e->hash = ht_hash(ht, e->node.key, e->node.key_size);
+		e->stripe = ht_lock_index(ht, e->hash);
+		e->pending = true;
+		data += e->node.key_size + value_size;
+	}
+	return 0;
+}
+
+// runs op for every pending entry, taking every stripe lock only once.
+// Entries must be sorted by batch_entry_cmp. Returns the count of entries
+// left pending because the table is write locked
+static unsigned int batch_run_locked(struct ht *ht, struct batch_entry *entries,
+			unsigned int count, int (*op)(struct ht *, struct batch_entry *))
+{
+	struct mutex *lock = NULL, *next;
+	unsigned int i, pending = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!entries[i].pending)
+			continue;
+		next = ht_bucket_lock(ht, entries[i].hash);
+		if (next != lock) {
+			if (lock != NULL)
+				mutex_unlock(lock);
+			lock = next;
+			ht_lock_bucket(ht, lock);
+		}
+		entries[i].result = op(ht, &entries[i]);
+		entries[i].pending = entries[i].result == -EAGAIN;
+		if (entries[i].pending)
+			pending++;
+	}
+	if (lock != NULL)
+		mutex_unlock(lock);
+	ht_check_resize(ht);
+	ht_check_budget(ht);
+	return pending;
+}
+
+static int batch_set(struct ht *ht, struct batch_entry *e)
+{
+	return ht_add_item_locked(ht, &e->node, true, 0, e->hash);
+}
+
+static int batch_del(struct ht *ht, struct batch_entry *e)
+{
+	return ht_del_item_locked(ht, e->node.key, e->node.key_size, e->hash);
+}
+
+// all items are referenced in a single RCU read section, values are
+// copied to user afterwards, so page faults do not delay other clients
+static void batch_get(struct ht *ht, struct batch_entry *entries,
+			ko_test_node *nodes, unsigned int count)
+{
+	struct batch_entry *e;
+	struct ht_item *item;
+	unsigned int i;
+
+	rcu_read_lock();
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		e->item = NULL;
+		if (e->result != 0)
+			continue;
+		item = ht_lookup_hash(ht, e->node.key, e->node.key_size, e->hash);
+		if (item == NULL || !ht_item_tryget(item))
+			e->result = -ENOENT;
+		else
+			e->item = item;
+	}
+	rcu_read_unlock();
+
+	for (i = 0; i < count; i++) {
+		e = &entries[i];
+		item = e->item;
+		if (item == NULL)
+			continue;
+		nodes[i].value_size = item->value_size;
+		if (item->value_size > e->node.value_size) {
+			ht_stat_inc(ht, HT_STAT_ENOSPC);
+			e->result = -ENOSPC;
+		}
+		else if (copy_to_user(nodes[i].value, item->value, item->value_size) != 0)
+			e->result = -EFAULT;
+		ht_item_put(item);
+	}
+}
+
+// blocking writers sleep while some file is in locked read mode.
+// Returns 0 if the write should be retried
+static int wait_writable(struct file *file)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+
+	// the file in locked read mode would wait for itself
+	if ((file->f_flags & O_NONBLOCK) || READ_ONCE(fd->locked))
+		return -EAGAIN;
+	return wait_event_interruptible(fd->table->write_wq,
+					!ht_writes_locked(&fd->table->ht));
+}
+
+static int device_batch_ioctl(struct file *file, unsigned int cmd,
+			void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ht *ht = &fd->table->ht;
+	ko_test_batch batch;
+	ko_test_node *nodes;
+	struct batch_entry *entries;
+	int *results;
+	char *data = NULL;
+	unsigned int i;
+	int res;
+
+	if (copy_from_user(&batch, arg_user, sizeof(batch)) != 0)
+		return -EFAULT;
+	if (batch.count == 0)
+		return 0;
+	if (batch.count > KO_TEST_MAX_BATCH || batch.nodes == NULL || batch.results == NULL)
+		return -EINVAL;
+
+	nodes = kvmalloc_array(batch.count, sizeof(ko_test_node), GFP_KERNEL);
+	entries = kvmalloc_array(batch.count, sizeof(struct batch_entry), GFP_KERNEL);
+	results = kvmalloc_array(batch.count, sizeof(int), GFP_KERNEL);
+	if (nodes == NULL || entries == NULL || results == NULL) {
+		res = -ENOMEM;
+		goto out;
+	}
+	if (copy_from_user(nodes, batch.nodes, batch.count * sizeof(ko_test_node)) != 0) {
+		res = -EFAULT;
+		goto out;
+	}
+	res = load_batch_user(ht, nodes, batch.count, cmd == KO_TEST_IOCTL_MSET,
+				entries, &data);
+	if (res != 0)
+		goto out;
+
+	switch (cmd) {
+	case KO_TEST_IOCTL_MGET:
+		batch_get(ht, entries, nodes, batch.count);
+		if (copy_to_user(batch.nodes, nodes, batch.count * sizeof(ko_test_node)) != 0)
+			res = -EFAULT;
+		break;
+	case KO_TEST_IOCTL_MSET:
+	case KO_TEST_IOCTL_MDEL:
+		sort(entries, batch.count, sizeof(struct batch_entry), batch_entry_cmp, NULL);
+		while (batch_run_locked(ht, entries, batch.count,
+				cmd == KO_TEST_IOCTL_MSET ? batch_set : batch_del) != 0 &&
+			wait_writable(file) == 0)
+			;
+		break;
+	}
+
+	for (i = 0; i < batch.count; i++)
+		results[entries[i].index] = entries[i].result;
+	if (copy_to_user(batch.results, results, batch.count * sizeof(int)) != 0)
+		res = -EFAULT;
+out:
+	kvfree(data);
+	kvfree(results);
+	kvfree(entries);
+	kvfree(nodes);
+	return res;
+}
+
+// records are copied from user space one by one, so the image is never
+// held in kernel memory as a whole
+static int device_load_ioctl(struct file *file, void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ht *ht = &fd->table->ht;
+	ko_test_load load;
+	ko_test_record rec;
+	ko_test_node node;
+	char __user *src;
+	char *data = NULL;
+	u64 offset = 0, need, data_size = 0;
+	unsigned int count = 0;
+	bool trusted;
+	int res = 0;
+
+	if (copy_from_user(&load, arg_user, sizeof(load)) != 0)
+		return -EFAULT;
+	if ((load.flags & ~KO_TEST_LOAD_TRUSTED) != 0 || (load.buf == NULL && load.size != 0))
+		return -EINVAL;
+	trusted = load.flags & KO_TEST_LOAD_TRUSTED;
+	// trusted records are linked without a lookup, keys already in the
+	// table would be duplicated
+	if (trusted && ht_item_count(ht) != 0)
+		return -EBUSY;
+	src = load.buf;
+
+	// count only sizes the table, the image cannot hold more records
+	ht_load_begin(ht, min_t(u64, load.count,
+			div_u64(load.size, KO_TEST_RECORD_SIZE(1, 0))));
+	while (offset < load.size) {
+		if (load.size - offset < sizeof(rec)) {
+			res = -EINVAL;
+			break;
+		}
+		if (copy_from_user(&rec, src + offset, sizeof(rec)) != 0) {
+			res = -EFAULT;
+			break;
+		}
+		need = (u64)rec.key_size + rec.value_size;
+		if (rec.key_size == 0 || rec.key_size > INT_MAX || rec.value_size > INT_MAX ||
+			need > load.size - offset - sizeof(rec)) {
+			res = -EINVAL;
+			break;
+		}
+		if (need > data_size) {
+			kvfree(data);
+			data_size = 0;
+			if ((data = kvmalloc(need, GFP_KERNEL)) == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			data_size = need;
+		}
+		if (copy_from_user(data, src + offset + sizeof(rec), need) != 0) {
+			res = -EFAULT;
+			break;
+		}
+		node.key = data;
+		node.key_size = rec.key_size;
+		node.value = data + rec.key_size;
+		node.value_size = rec.value_size;
+		while ((res = ht_load_item(ht, &node, trusted)) == -EAGAIN &&
+			(res = wait_writable(file)) == 0)
+			;
+		if (res != 0)
+			break;
+		// the last record may end without padding
+		offset += min_t(u64, KO_TEST_RECORD_SIZE(rec.key_size, rec.value_size),
+				load.size - offset);
+		count++;
+		if (fatal_signal_pending(current)) {
+			res = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+	ht_load_end(ht);
+	kvfree(data);
+
+	if (put_user(count, &((ko_test_load __user *)arg_user)->count) != 0)
+		res = -EFAULT;
+	return res;
+}
+
+// ko_test_update starts with the node, the key and the value are loaded
+// from there
+static int device_update_ioctl(struct file *file, unsigned int cmd,
+			void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ht *ht = &fd->table->ht;
+	ko_test_update __user *update_user = arg_user;
+	ko_test_update update;
+	char *expected = NULL;
+	s64 number = 0;
+	u64 version;
+	int res;
+
+	if (copy_from_user(&update, arg_user, sizeof(update)) != 0)
+		return -EFAULT;
+	if (cmd == KO_TEST_IOCTL_CAS && update.expected != NULL) {
+		if (update.expected_size < 0)
+			return -EINVAL;
+		expected = memdup_user(update.expected, update.expected_size);
+		if (IS_ERR(expected))
+			return PTR_ERR(expected);
+	}
+	if (cmd == KO_TEST_IOCTL_INCR) {
+		res = load_key_user(&update.node.key, &update.node);
+		update.node.value = NULL;
+	} else
+		res = load_key_value_user(&update.node, arg_user);
+	if (res != 0) {
+		kfree(expected);
+		return res;
+	}
+
+	version = update.version;
+	do {
+		switch (cmd) {
+		case KO_TEST_IOCTL_CAS:
+			res = ht_cas_item(ht, &update.node, expected,
+					update.expected_size, &version);
+			break;
+		case KO_TEST_IOCTL_INCR:
+			res = ht_incr_item(ht, update.node.key, update.node.key_size,
+					update.number, &number, &version);
+			break;
+		default:
+			res = ht_append_item(ht, &update.node, &version);
+			break;
+		}
+	} while (res == -EAGAIN && (res = wait_writable(file)) == 0);
+
+	if ((res == 0 || res == -ECANCELED) &&
+		put_user(version, &update_user->version) != 0)
+		res = -EFAULT;
+	if (res == 0 && cmd == KO_TEST_IOCTL_INCR &&
+		put_user(number, &update_user->number) != 0)
+		res = -EFAULT;
+	kfree(update.node.key);
+	kfree(update.node.value);
+	kfree(expected);
+	return res;
+}
+
+static bool ring_range_valid(const struct ko_ring *ring, unsigned int offset,
+			unsigned int size)
+{
+	return offset <= ring->data_size && size <= ring->data_size - offset;
+}
+
+static int ring_reserve_scratch(struct ko_ring *ring, size_t size)
+{
+	char *scratch;
+
+	if (size <= ring->scratch_size)
+		return 0;
+	scratch = kvmalloc(size, GFP_KERNEL);
+	if (scratch == NULL)
+		return -ENOMEM;
+	kvfree(ring->scratch);
+	ring->scratch = scratch;
+	ring->scratch_size = size;
+	return 0;
+}
+
+static int ring_get(struct ko_ring *ring, const ko_test_sqe *sqe,
+			const char *key, ko_test_cqe *cqe)
+{
+	struct ht *ht = &ring->table->ht;
+	struct ht_item *item;
+	int res = 0;
+
+	item = ht_get_item(ht, key, sqe->key_size);
+	if (item == NULL)
+		return -ENOENT;
+	if (item->value_size > sqe->value_size) {
+		ht_stat_inc(ht, HT_STAT_ENOSPC);
+		res = -ENOSPC;
+	} else
+		memcpy(ring->data + sqe->value_offset, item->value, item->value_size);
+	cqe->value_size = item->value_size;
+	cqe->version = item->version;
+	ht_item_put(item);
+	return res;
+}
+
+// runs one submission, sqe is a private copy. Keys and values are copied
+// out of the data area first, the client may change it meanwhile
+static int ring_exec(struct ko_ring *ring, const ko_test_sqe *sqe,
+			ko_test_cqe *cqe)
+{
+	struct ht *ht = &ring->table->ht;
+	bool write = sqe->opcode == KO_TEST_RING_SET || sqe->opcode == KO_TEST_RING_ADD;
+	ko_test_node node;
+	int res;
+
+	if (sqe->opcode < KO_TEST_RING_GET || sqe->opcode > KO_TEST_RING_DEL)
+		return -EINVAL;
+	if (sqe->key_size == 0 ||
+		!ring_range_valid(ring, sqe->key_offset, sqe->key_size) ||
+		(sqe->opcode != KO_TEST_RING_DEL &&
+		!ring_range_valid(ring, sqe->value_offset, sqe->value_size)))
+		return -EINVAL;
+	res = ring_reserve_scratch(ring, sqe->key_size + (write ? sqe->value_size : 0));
+	if (res != 0)
+		return res;
+
+	node.key = ring->scratch;
+	node.key_size = sqe->key_size;
+	memcpy(node.key, ring->data + sqe->key_offset, sqe->key_size);
+	switch (sqe->opcode) {
+	case KO_TEST_RING_GET:
+		return ring_get(ring, sqe, node.key, cqe);
+	case KO_TEST_RING_DEL:
+		return ht_del_item(ht, node.key, node.key_size);
+	default:
+		node.value = ring->scratch + sqe->key_size;
+		node.value_size = sqe->value_size;
+		memcpy(node.value, ring->data + sqe->value_offset, sqe->value_size);
+		return ht_add_item(ht, &node, sqe->opcode == KO_TEST_RING_SET,
+				sqe->ttl_ms);
+	}
+}
+
+// there are submissions and room for their completions, ring lock must be
+// held or the caller must be the only consumer
+static bool ring_runnable(struct ko_ring *ring)
+{
+	ko_test_ring_header *header = ring->header;
+
+	return ring->sq_head != smp_load_acquire(&header->sq_tail) &&
+		ring->cq_tail - READ_ONCE(header->cq_head) < ring->entries;
+}
+
+// runs the pending submissions while the completion ring has room, at most
+// one ring of them so a busy client does not keep the caller forever.
+// Returns the number of submissions run
+static unsigned int ring_run(struct ko_ring *ring)
+{
+	ko_test_ring_header *header = ring->header;
+	unsigned int mask = ring->entries - 1;
+	unsigned int count = 0;
+	ko_test_sqe sqe;
+	ko_test_cqe cqe;
+
+	mutex_lock(&ring->lock);
+	while (count < ring->entries && ring_runnable(ring)) {
+		memcpy(&sqe, &ring->sq[ring->sq_head & mask], sizeof(sqe));
+		// the checks must see the copy, not the shared slot
+		barrier();
+		memset(&cqe, 0, sizeof(cqe));
+		cqe.user_data = sqe.user_data;
+		cqe.res = ring_exec(ring, &sqe, &cqe);
+		ring->cq[ring->cq_tail & mask] = cqe;
+		ring->sq_head++;
+		ring->cq_tail++;
+		// the completion is written before the tail is
+		smp_store_release(&header->cq_tail, ring->cq_tail);
+		WRITE_ONCE(header->sq_head, ring->sq_head);
+		count++;
+		cond_resched();
+	}
+	mutex_unlock(&ring->lock);
+	return count;
+}
+
+static void ring_worker(struct work_struct *work)
+{
+	struct ko_ring *ring = container_of(to_delayed_work(work), struct ko_ring, work);
+	ko_test_ring_header *header = ring->header;
+	unsigned long delay = 1;
+
+	if (ring_run(ring) != 0) {
+		WRITE_ONCE(ring->idle_since, jiffies);
+		delay = 0;
+	} else if (time_after(jiffies, READ_ONCE(ring->idle_since) +
+			msecs_to_jiffies(RING_IDLE_MS))) {
+		// no progress, also with a full completion ring the client does
+		// not consume. The client checks the flag after its sq_tail
+		// store, a submission it has not seen the flag for is seen here
+		smp_store_mb(header->flags, KO_TEST_RING_NEED_WAKEUP);
+		if (!ring_runnable(ring))
+			return;
+		WRITE_ONCE(header->flags, 0);
+		WRITE_ONCE(ring->idle_since, jiffies);
+	}
+	queue_delayed_work(system_unbound_wq, &ring->work, delay);
+}
+
+static void ring_destroy(struct ko_ring *ring)
+{
+	if (ring->poll)
+		cancel_delayed_work_sync(&ring->work);
+	mutex_destroy(&ring->lock);
+	kvfree(ring->scratch);
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+static int device_ring_setup_ioctl(struct file *file, void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	ko_test_ring_params params;
+	struct ko_ring *ring;
+	int res = 0;
+
+	if (copy_from_user(&params, arg_user, sizeof(params)) != 0)
+		return -EFAULT;
+	if (params.entries == 0 || params.entries > KO_TEST_RING_MAX_ENTRIES ||
+		(params.entries & (params.entries - 1)) != 0 ||
+		params.data_size > KO_TEST_MAX_BATCH_DATA ||
+		(params.flags & ~KO_TEST_RING_POLL) != 0)
+		return -EINVAL;
+	params.sq_offset = RING_HEADER_SIZE;
+	params.cq_offset = params.sq_offset + params.entries * sizeof(ko_test_sqe);
+	params.data_offset = ALIGN(params.cq_offset +
+			params.entries * sizeof(ko_test_cqe), RING_HEADER_SIZE);
+	params.size = PAGE_ALIGN(params.data_offset + params.data_size);
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (ring == NULL)
+		return -ENOMEM;
+	// zeroed, the client gets no stale kernel memory
+	ring->mem = vmalloc_user(params.size);
+	if (ring->mem == NULL) {
+		kfree(ring);
+		return -ENOMEM;
+	}
+	ring->table = fd->table;
+	ring->size = params.size;
+	ring->header = ring->mem;
+	ring->sq = ring->mem + params.sq_offset;
+	ring->cq = ring->mem + params.cq_offset;
+	ring->data = ring->mem + params.data_offset;
+	ring->entries = params.entries;
+	ring->data_size = params.data_size;
+	ring->poll = params.flags & KO_TEST_RING_POLL;
+	ring->idle_since = jiffies;
+	mutex_init(&ring->lock);
+	INIT_DELAYED_WORK(&ring->work, ring_worker);
+
+	mutex_lock(&fd->lock);
+	if (fd->ring != NULL)
+		res = -EBUSY;
+	else
+		// mmap and RING_ENTER see the ring complete
+		smp_store_release(&fd->ring, ring);
+	mutex_unlock(&fd->lock);
+	if (res != 0) {
+		ring_destroy(ring);
+		return res;
+	}
+	if (ring->poll)
+		queue_delayed_work(system_unbound_wq, &ring->work, 0);
+	if (copy_to_user(arg_user, &params, sizeof(params)) != 0)
+		return -EFAULT;
+	return 0;
+}
+
+static long device_ring_enter_ioctl(struct file *file)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ko_ring *ring = smp_load_acquire(&fd->ring);
+
+	if (ring == NULL)
+		return -EINVAL;
+	if (!ring->poll)
+		return ring_run(ring);
+	WRITE_ONCE(ring->header->flags, 0);
+	WRITE_ONCE(ring->idle_since, jiffies);
+	mod_delayed_work(system_unbound_wq, &ring->work, 0);
+	return 0;
+}
+
+// every vma of a value mapping holds a reference to the item
+static void value_vm_open(struct vm_area_struct *vma)
+{
+	ht_item_get(vma->vm_private_data);
+}
+
+static void value_vm_close(struct vm_area_struct *vma)
+{
+	ht_item_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct value_vm_ops = {
+	.open = value_vm_open,
+	.close = value_vm_close,
+};
+
+static int map_value(struct vm_area_struct *vma, struct ht_item *item)
+{
+	int res;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+	// items never change, mprotect must not make the pages writable
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	res = remap_vmalloc_range(vma, item->value, 0);
+	if (res != 0)
+		return res;
+	ht_item_get(item);
+	vma->vm_private_data = item;
+	vma->vm_ops = &value_vm_ops;
+	return 0;
+}
+
+// the mapping is made by vm_mmap() of the ioctl itself, so the value is
+// mapped only for the task that holds it in map_task
+static int device_map_value_ioctl(struct file *file, void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ht_item *item;
+	ko_test_map map;
+	unsigned long addr;
+	char *key;
+	int res = 0;
+
+	if (copy_from_user(&map, arg_user, sizeof(map)) != 0)
+		return -EFAULT;
+	if (map.key_size <= 0 || map.key == NULL)
+		return -EINVAL;
+	key = memdup_user(map.key, map.key_size);
+	if (IS_ERR(key))
+		return PTR_ERR(key);
+	item = ht_get_item(&fd->table->ht, key, map.key_size);
+	kfree(key);
+	if (item == NULL)
+		return -ENOENT;
+	if (!item->paged) {
+		ht_item_put(item);
+		return -EOPNOTSUPP;
+	}
+
+	mutex_lock(&fd->lock);
+	fd->map_item = item;
+	WRITE_ONCE(fd->map_task, current);
+	addr = vm_mmap(file, 0, item->value_size, PROT_READ, MAP_SHARED, 0);
+	WRITE_ONCE(fd->map_task, NULL);
+	fd->map_item = NULL;
+	mutex_unlock(&fd->lock);
+
+	if (IS_ERR_VALUE(addr))
+		res = (int)addr;
+	else {
+		map.value = (const char __user *)addr;
+		map.value_size = item->value_size;
+		map.version = item->version;
+		if (copy_to_user(arg_user, &map, sizeof(map)) != 0) {
+			vm_munmap(addr, item->value_size);
+			res = -EFAULT;
+		}
+	}
+	ht_item_put(item);
+	return res;
+}
+
+// maps the rings or the value of MAP_VALUE. mmap_lock is held here so
+// fd->lock is not taken: it is held over copies from user memory
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ko_ring *ring;
+
+	if (READ_ONCE(fd->map_task) == current)
+		return map_value(vma, fd->map_item);
+	ring = smp_load_acquire(&fd->ring);
+	if (ring == NULL || vma->vm_pgoff != 0 ||
+		vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+static void read_scan_end(struct file_data *fd)
+{
+	kvfree(fd->batch);
+	fd->batch = NULL;
+	fd->batch_size = 0;
+	fd->batch_used = 0;
+	fd->batch_pos = 0;
+	fd->scan = false;
+	fd->ranged = false;
+	ht_range_free(&fd->range);
+}
+
+// refills the batch with records of the next buckets. The batch is empty
+// on return only when the scan is done
+static int scan_fill(struct file_data *fd)
+{
+	size_t need, size;
+	char *batch;
+	long res;
+
+	fd->batch_pos = 0;
+	for (;;) {
+		if (fd->ranged) {
+			res = ht_range_scan(&fd->table->ht, &fd->range, fd->batch,
+					fd->batch_size, &fd->batch_used);
+			if (res < 0)
+				return res;
+			need = res;
+			fd->scan_done = fd->range.done;
+		} else
+			need = ht_scan(&fd->table->ht, &fd->scan_pos, &fd->scan_done,
+					fd->batch, fd->batch_size, &fd->batch_used);
+		if (fd->batch_used != 0 || fd->scan_done)
+			return 0;
+		if (need != 0 || fd->batch == NULL) {
+			size = max_t(size_t, need, SCAN_BATCH_SIZE);
+			batch = kvmalloc(size, GFP_KERNEL);
+			if (batch == NULL)
+				return -ENOMEM;
+			kvfree(fd->batch);
+			fd->batch = batch;
+			fd->batch_size = size;
+		}
+		cond_resched();
+	}
+}
+
+// scan mode over a key range of the ordered index
+static int device_read_range_ioctl(struct file *file, void __user *arg_user)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	struct ht_range range = { };
+	ko_test_range arg;
+	int res = 0;
+
+	if (!fd->table->ht.ordered)
+		return -EOPNOTSUPP;
+	if (copy_from_user(&arg, arg_user, sizeof(arg)) != 0)
+		return -EFAULT;
+	if ((arg.flags & ~KO_TEST_RANGE_PREFIX) != 0 ||
+		arg.start_size < 0 || (arg.start == NULL && arg.start_size != 0) ||
+		arg.end_size < 0 || (arg.end == NULL && arg.end_size != 0))
+		return -EINVAL;
+
+	if (arg.start != NULL) {
+		range.from = memdup_user(arg.start, arg.start_size);
+		if (IS_ERR(range.from))
+			return PTR_ERR(range.from);
+		range.from_size = arg.start_size;
+	}
+	// a prefix is both the start and the limit
+	if (arg.flags & KO_TEST_RANGE_PREFIX) {
+		range.prefix = true;
+		arg.end = arg.start;
+		arg.end_size = arg.start_size;
+	}
+	if (arg.end != NULL) {
+		range.to = memdup_user(arg.end, arg.end_size);
+		if (IS_ERR(range.to)) {
+			res = PTR_ERR(range.to);
+			range.to = NULL;
+			ht_range_free(&range);
+			return res;
+		}
+		range.to_size = arg.end_size;
+	}
+
+	mutex_lock(&fd->lock);
+	if (fd->locked || fd->scan)
+		res = -EBUSY;
+	else {
+		fd->scan = true;
+		fd->ranged = true;
+		fd->range = range;
+		fd->scan_done = false;
+		fd->batch_used = 0;
+		fd->batch_pos = 0;
+	}
+	mutex_unlock(&fd->lock);
+	if (res != 0)
+		ht_range_free(&range);
+	return res;
+}
+
+static int read_next_scan(struct file_data *fd, ko_test_node *node)
+{
+	ko_test_record *rec;
+	char *data;
+	int res = 0;
+
+	if (fd->batch_pos == fd->batch_used) {
+		if ((res = scan_fill(fd)) != 0)
+			return res;
+		if (fd->batch_used == 0)
+			return -ENOENT;
+	}
+	rec = (ko_test_record *)(fd->batch + fd->batch_pos);
+	data = (char *)(rec + 1);
+	if (node->value_size < (int)rec->value_size || node->key_size < (int)rec->key_size)
+		res = -ENOSPC;
+	else if (copy_to_user(node->key, data, rec->key_size) != 0 ||
+		copy_to_user(node->value, data + rec->key_size, rec->value_size) != 0)
+		res = -EFAULT;
+	node->key_size = rec->key_size;
+	node->value_size = rec->value_size;
+	if (res == 0)
+		fd->batch_pos += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+	return res;
+}
+
+// records are already packed in the batch, so they go to user space by
+// one copy per batch
+static int read_bulk_scan(struct file_data *fd, ko_test_bulk *bulk)
+{
+	char __user *dst = bulk->buf;
+	ko_test_record *rec;
+	size_t chunk, record_size = 0;
+	unsigned int count;
+	int res;
+
+	bulk->count = 0;
+	bulk->used = 0;
+	for (;;) {
+		if (fd->batch_pos == fd->batch_used) {
+			if ((res = scan_fill(fd)) != 0)
+				return res;
+			if (fd->batch_used == 0)
+				return bulk->count != 0 ? 0 : -ENOENT;
+		}
+		chunk = 0;
+		count = 0;
+		while (fd->batch_pos + chunk < fd->batch_used) {
+			rec = (ko_test_record *)(fd->batch + fd->batch_pos + chunk);
+			record_size = KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+			if (record_size > bulk->size - bulk->used - chunk)
+				break;
+			chunk += record_size;
+			count++;
+		}
+		if (count == 0) {
+			if (bulk->count != 0)
+				return 0;
+			bulk->size = record_size;
+			return -ENOSPC;
+		}
+		if (copy_to_user(dst + bulk->used, fd->batch + fd->batch_pos, chunk) != 0)
+			return -EFAULT;
+		fd->batch_pos += chunk;
+		bulk->used += chunk;
+		bulk->count += count;
+	}
+}
+
+// locked read mode only, packs records starting at the cursor into the
+// user buffer
+static int read_bulk_locked(struct file_data *fd, ko_test_bulk *bulk)
+{
+	char __user *dst = bulk->buf;
+	struct ht_item *item;
+	ko_test_record rec;
+	unsigned long record_size;
+	unsigned int used = 0;
+
+	bulk->count = 0;
+	bulk->used = 0;
+	if (fd->pos == NULL)
+		return -ENOENT;
+
+	while (fd->pos != NULL) {
+		// table is write locked, so the item may not change
+		item = fd->pos;
+		record_size = KO_TEST_RECORD_SIZE(item->key_size, item->value_size);
+		if (record_size > bulk->size - used) {
+			if (bulk->count != 0)
+				break;
+			bulk->size = record_size;
+			return -ENOSPC;
+		}
+		rec.key_size = item->key_size;
+		rec.value_size = item->value_size;
+		if (copy_to_user(dst + used, &rec, sizeof(rec)) != 0 ||
+			copy_to_user(dst + used + sizeof(rec), item->key, rec.key_size) != 0 ||
+			copy_to_user(dst + used + sizeof(rec) + rec.key_size, item->value,
+					rec.value_size) != 0)
+			return -EFAULT;
+		used += record_size;
+		bulk->used = used;
+		bulk->count++;
+		ht_read_next(&fd->table->ht, &fd->bucket, &fd->pos);
+	}
+	return 0;
+}
+
+static long device_unlocked_ioctl(struct file *file, unsigned int cmd, unsigned long argp)
+{
+	struct file_data *fd;
+	struct ht *ht;
+	void __user *arg_user;
+	int res = 0;
+
+	fd = (struct file_data *)file->private_data;
+	ht = &fd->table->ht;
+	arg_user = (void __user *)argp;
+	switch (cmd) {
+	case KO_TEST_IOCTL_VERSION: {
+		char data[KO_TEST_MAX_VERSION_SIZE];
+		sprintf(data, "%s-%s", DEVICE_NAME, THIS_MODULE->version);
+		if (copy_to_user(arg_user, data, strlen(data) + 1) != 0)
+			return -EFAULT;
+		return 0;
+	}
+
+	case KO_TEST_IOCTL_SET:
+	case KO_TEST_IOCTL_ADD:
+	case KO_TEST_IOCTL_SET_TTL:
+	case KO_TEST_IOCTL_ADD_TTL: {
+		ko_test_node node;
+		unsigned int ttl_ms = 0;
+		bool allow_replace = cmd == KO_TEST_IOCTL_SET || cmd == KO_TEST_IOCTL_SET_TTL;
+
+		// ko_test_ttl_node starts with the node
+		if ((cmd == KO_TEST_IOCTL_SET_TTL || cmd == KO_TEST_IOCTL_ADD_TTL) &&
+			get_user(ttl_ms, &((ko_test_ttl_node __user *)arg_user)->ttl_ms) != 0)
+			return -EFAULT;
+		if ((res = load_key_value_user(&node, arg_user)) != 0)
+			return res;
+		while ((res = ht_add_item(ht, &node, allow_replace, ttl_ms)) == -EAGAIN &&
+			(res = wait_writable(file)) == 0)
+			;
+		kfree(node.key);
+		kfree(node.value);
+		return res;
+	}
+	case KO_TEST_IOCTL_GET:
+	case KO_TEST_IOCTL_GETV: {
+		ko_test_node node;
+		struct ht_item *item;
+		u64 version;
+		char *key;
+
+		if (copy_from_user(&node, arg_user, sizeof(ko_test_node)) != 0)
+			return -EFAULT;
+		if ((res = load_key_user(&key, &node)) != 0)
+			return res;
+
+		item = ht_get_item(ht, key, node.key_size);
+		kfree(key);
+		if (item == NULL)
+			return -ENOENT;
+		// no locks are held here, the reference keeps the value
+		if (item->value_size > node.value_size) {
+			ht_stat_inc(ht, HT_STAT_ENOSPC);
+			res = -ENOSPC;
+		}
+		else if (copy_to_user(node.value, item->value, item->value_size) != 0)
+			res = -EFAULT;
+		node.value_size = item->value_size;
+		version = item->version;
+		ht_item_put(item);
+		// ko_test_update starts with the node
+		if (copy_to_user(arg_user, &node, sizeof(node)) != 0)
+			res = -EFAULT;
+		if (cmd == KO_TEST_IOCTL_GETV &&
+			put_user(version, &((ko_test_update __user *)arg_user)->version) != 0)
+			res = -EFAULT;
+		return res;
+	}
+	case KO_TEST_IOCTL_DEL: {
+		ko_test_node node;
+		char *key;
+
+		if (copy_from_user(&node, arg_user, sizeof(ko_test_node)) != 0)
+			return -EFAULT;
+		if ((res = load_key_user(&key, &node)) != 0)
+			return res;
+
+		while ((res = ht_del_item(ht, key, node.key_size)) == -EAGAIN &&
+			(res = wait_writable(file)) == 0)
+			;
+		kfree(key);
+		return res;
+	}
+	case KO_TEST_IOCTL_COUNT: {
+		int count = ht_item_count(ht);
+
+		if (copy_to_user(arg_user, &count, sizeof(int)) != 0)
+			return -EFAULT;
+		return 0;
+	}
+	case KO_TEST_IOCTL_MGET:
+	case KO_TEST_IOCTL_MSET:
+	case KO_TEST_IOCTL_MDEL:
+		return device_batch_ioctl(file, cmd, arg_user);
+	case KO_TEST_IOCTL_READ_BEGIN: {
+		mutex_lock(&fd->lock);
+		if (fd->locked || fd->scan)
+			res = -EBUSY;
+		else {
+			fd->scan = true;
+			fd->scan_done = false;
+			fd->scan_pos = 0;
+			fd->batch_used = 0;
+			fd->batch_pos = 0;
+		}
+		mutex_unlock(&fd->lock);
+		return res;
+	}
+	case KO_TEST_IOCTL_READ_BEGIN_LOCKED: {
+		mutex_lock(&fd->lock);
+		if (fd->locked || fd->scan || !ht_lock_writes(ht))
+			res = -EBUSY;
+		else {
+			fd->locked = true;
+			ht_read_init(ht, &fd->bucket, &fd->pos);
+		}
+		mutex_unlock(&fd->lock);
+		return res;
+	}
+	case KO_TEST_IOCTL_READ_END: {
+		mutex_lock(&fd->lock);
+		if (fd->scan)
+			read_scan_end(fd);
+		else if (!fd->locked)
+			res = -EBUSY;
+		else {
+			fd->locked = false;
+			ht_unlock_writes(ht);
+			wake_up_interruptible_all(&fd->table->write_wq);
+		}
+		mutex_unlock(&fd->lock);
+		return res;
+	}
+	case KO_TEST_IOCTL_READ_NEXT: {
+		ko_test_node node;
+		struct ht_item *item;
+
+		if (copy_from_user(&node, arg_user, sizeof(ko_test_node)) != 0)
+			return -EFAULT;
+
+		mutex_lock(&fd->lock);
+		if (fd->scan) {
+			res = read_next_scan(fd, &node);
+			mutex_unlock(&fd->lock);
+			if (res != -ENOENT && res != -ENOMEM &&
+				copy_to_user(arg_user, &node, sizeof(node)) != 0)
+				res = -EFAULT;
+			return res;
+		}
+		if (!fd->locked) {
+			mutex_unlock(&fd->lock);
+			return -EBUSY;
+		}
+		if (fd->pos == NULL) {
+			mutex_unlock(&fd->lock);
+			return -ENOENT;
+		}
+
+		// table is write locked, so the item may not change
+		item = fd->pos;
+		if (node.value_size < item->value_size)
+			res = -ENOSPC;
+		if (node.key_size < item->key_size)
+			res = -ENOSPC;
+
+		if (res == 0) {
+			if (copy_to_user(node.key, item->key, item->key_size) != 0)
+				res = -EFAULT;
+			if (copy_to_user(node.value, item->value, item->value_size) != 0)
+				res = -EFAULT;
+		}
+		node.key_size = item->key_size;
+		node.value_size = item->value_size;
+		if (copy_to_user(arg_user, &node, sizeof(node)) != 0)
+			res = -EFAULT;
+		if (res == 0)
+			ht_read_next(ht, &fd->bucket, &fd->pos);
+		mutex_unlock(&fd->lock);
+		return res;
+	}
+	case KO_TEST_IOCTL_LOAD:
+		return device_load_ioctl(file, arg_user);
+	case KO_TEST_IOCTL_CAS:
+	case KO_TEST_IOCTL_INCR:
+	case KO_TEST_IOCTL_APPEND:
+		return device_update_ioctl(file, cmd, arg_user);
+	case KO_TEST_IOCTL_READ_BEGIN_RANGE:
+		return device_read_range_ioctl(file, arg_user);
+	case KO_TEST_IOCTL_RING_SETUP:
+		return device_ring_setup_ioctl(file, arg_user);
+	case KO_TEST_IOCTL_RING_ENTER:
+		return device_ring_enter_ioctl(file);
+	case KO_TEST_IOCTL_MAP_VALUE:
+		return device_map_value_ioctl(file, arg_user);
+	case KO_TEST_IOCTL_READ_BULK: {
+		ko_test_bulk bulk;
+
+		if (copy_from_user(&bulk, arg_user, sizeof(bulk)) != 0)
+			return -EFAULT;
+
+		mutex_lock(&fd->lock);
+		if (fd->scan)
+			res = read_bulk_scan(fd, &bulk);
+		else if (!fd->locked)
+			res = -EBUSY;
+		else
+			res = read_bulk_locked(fd, &bulk);
+		mutex_unlock(&fd->lock);
+		if (copy_to_user(arg_user, &bulk, sizeof(bulk)) != 0)
+			res = -EFAULT;
+		return res;
+	}
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// reads never block, writes block while the table is write locked
+static __poll_t device_poll(struct file *file, poll_table *wait)
+{
+	struct file_data *fd = (struct file_data *)file->private_data;
+	__poll_t mask = EPOLLIN | EPOLLRDNORM;
+
+	poll_wait(file, &fd->table->write_wq, wait);
+	if (!ht_writes_locked(&fd->table->ht))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	return mask;
+}
+
+static int device_open(struct inode *inode, struct file *file)
+{
+	struct file_data *fd;
+
+	if (iminor(inode) >= tables)
+		return -ENODEV;
+	fd = kzalloc(sizeof(struct file_data), GFP_KERNEL);
+	if (fd == NULL)
+		return -ENOMEM;
+
+	fd->table = &ko_tables[iminor(inode)];
+	mutex_init(&fd->lock);
+	file->private_data = fd;
+	return 0;
+}
+
+static int device_release(struct inode *inode, struct file *file)
+{
+	struct file_data *fd;
+
+	fd = (struct file_data *)file->private_data;
+	if (fd->locked) {
+		ht_unlock_writes(&fd->table->ht);
+		wake_up_interruptible_all(&fd->table->write_wq);
+	}
+	read_scan_end(fd);
+	if (fd->ring != NULL)
+		ring_destroy(fd->ring);
+	mutex_destroy(&fd->lock);
+	kfree(fd);
+	return 0;
+}
+
+static void destroy_table(struct ko_table *table)
+{
+	ht_destroy(&table->ht);
+	// files of the deleted items are removed before the items dir
+	flush_work(&ht_publish_work);
+	destroy_sysfs(table);
+	device_destroy(self_class, MKDEV(major_number, table->minor));
+}
+
+static int init_table(struct ko_table *table, unsigned int minor)
+{
+	unsigned int size;
+	int res;
+
+	table->minor = minor;
+	init_waitqueue_head(&table->write_wq);
+	size = hash_table_size[min(minor, max(hash_table_sizes, 1U) - 1)];
+	res = ht_init(&table->ht, size, hash_function, ht_flags, &ht_sysfs_ops);
+	if (res < 0) {
+		pr_err("failed to create hash table\n");
+		return res;
+	}
+
+	if (minor == 0)
+		table->device = device_create(self_class, NULL, MKDEV(major_number, 0),
+					NULL, DEVICE_NAME);
+	else
+		table->device = device_create(self_class, NULL, MKDEV(major_number, minor),
+					NULL, DEVICE_NAME "%u", minor);
+	if (IS_ERR_OR_NULL(table->device)) {
+		ht_destroy(&table->ht);
+		pr_err("failed to create the device\n");
+		return -ENOMEM;
+	}
+	res = init_sysfs(table);
+	if (res < 0) {
+		destroy_table(table);
+		pr_err("failed to create hash table\n");
+		return res;
+	}
+	pr_info("table %u size, specified %u, real %u\n",
+		minor, size, ht_bucket_count(&table->ht));
+	return 0;
+}
+
+static void destroy_tables(unsigned int count)
+{
+	while (count > 0)
+		destroy_table(&ko_tables[--count]);
+	kfree(ko_tables);
+}
+
+static int __init ko_test_init(void)
+{
+	unsigned int i;
+	int res = 0;
+	
+	pr_info("started\n");
+	if (tables == 0 || tables > MAX_TABLES) {
+		pr_err("tables must be 1 to %u\n", MAX_TABLES);
+		return -EINVAL;
+	}
+	if ((res = ht_flags_init()) != 0 || (res = ht_publish_init()) != 0)
+		return res;
+	ko_tables = kcalloc(tables, sizeof(struct ko_table), GFP_KERNEL);
+	if (ko_tables == NULL)
+		return -ENOMEM;
+	major_number = register_chrdev(0, DEVICE_NAME, &file_ops);
+	if (major_number < 0) {
+		kfree(ko_tables);
+		pr_err("failed to register a major number\n");
+		return major_number;
+	}
+
+	// Register the device class
+	self_class = class_create(THIS_MODULE, CLASS_NAME);
+	if (IS_ERR_OR_NULL(self_class)) {
+		// Check for error and clean up if there is
+		unregister_chrdev(major_number, DEVICE_NAME);
+		kfree(ko_tables);
+		pr_err("failed to register device class\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < tables; i++) {
+		res = init_table(&ko_tables[i], i);
+		if (res < 0) {
+			destroy_tables(i);
+			class_destroy(self_class);
+			unregister_chrdev(major_number, DEVICE_NAME);
+			return res;
+		}
+	}
+	res = register_ht_shrinker();
+	if (res < 0) {
+		destroy_tables(tables);
+		class_destroy(self_class);
+		unregister_chrdev(major_number, DEVICE_NAME);
+		pr_err("failed to register shrinker\n");
+		return res;
+	}
+	return 0;
+}
+
+static void __exit ko_test_exit(void)
+{
+	unregister_ht_shrinker();
+	destroy_tables(tables);
+	class_destroy(self_class);
+	unregister_chrdev(major_number, DEVICE_NAME);
+	pr_info("stopped\n");
+}
+
+module_init(ko_test_init);
+module_exit(ko_test_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("George Stark");
+MODULE_DESCRIPTION("Test to get a job)");
+MODULE_VERSION("0.3");
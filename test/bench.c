@@ -0,0 +1,737 @@
+// Multi-threaded load generator for ko_test. Every thread opens the device
+// and runs a random mix of operations over a fixed key space, results are
+// printed as a single JSON object, see usage()
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "../ko_test_ioctl.h"
+
+#define DEFAULT_DEV "/dev/ko_test_device"
+#define MAX_THREADS 256
+
+enum op
+{
+	OP_GET,
+	OP_SET,
+	OP_ADD,
+	OP_DEL,
+	OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = { "get", "set", "add", "del" };
+
+// latency histogram: values below 16 ns are exact, above that every power
+// of two is split into 16 buckets, so the error is within 1/16
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SIZE (64 * HIST_SUB)
+
+struct op_stats
+{
+	uint64_t count;
+	uint64_t errors;
+	uint64_t hist[HIST_SIZE];
+};
+
+enum phase
+{
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	PHASE_STOP
+};
+
+struct config
+{
+	const char *dev;
+	int threads;
+	double warmup;
+	double duration;
+	unsigned long keys;
+	int key_min, key_max;
+	int value_min, value_max;
+	unsigned int mix[OP_COUNT];
+	double zipf;
+	int prefill;
+	// run operations through the rings, ring_depth of them in flight
+	unsigned int ring_depth;
+	int ring_poll;
+};
+
+struct zipf
+{
+	unsigned long n;
+	double theta, alpha, zetan, eta;
+};
+
+struct ring
+{
+	void *mem;
+	size_t size;
+	ko_test_ring_header *header;
+	ko_test_sqe *sq;
+	ko_test_cqe *cq;
+	char *data;
+	unsigned int mask;
+	// operation and submit time of every in-flight slot
+	enum op *ops;
+	uint64_t *start;
+};
+
+struct thread
+{
+	pthread_t id;
+	uint64_t rng;
+	char *key;
+	char *value;
+	struct op_stats stats[OP_COUNT];
+};
+
+static struct config cfg = {
+	.dev = DEFAULT_DEV,
+	.threads = 4,
+	.warmup = 2,
+	.duration = 10,
+	.keys = 100000,
+	.key_min = 8, .key_max = 32,
+	.value_min = 16, .value_max = 128,
+	.mix = { 90, 10, 0, 0 },
+	.zipf = 0,
+	.prefill = 1,
+};
+
+static struct zipf zipf;
+static volatile int phase;
+
+static uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+// xorshift64*, state must not be zero
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_double(uint64_t *state)
+{
+	return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+// Zipfian generator by Gray et al., "Quickly generating billion-record
+// synthetic databases", the same one is used by YCSB
+static void zipf_init(struct zipf *z, unsigned long n, double theta)
+{
+	double zeta2 = 1 + pow(0.5, theta);
+	unsigned long i;
+
+	z->n = n;
+	z->theta = theta;
+	z->zetan = 0;
+	for (i = 1; i <= n; i++)
+		z->zetan += 1 / pow(i, theta);
+	z->alpha = 1 / (1 - theta);
+	z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z->zetan);
+}
+
+static unsigned long zipf_next(const struct zipf *z, uint64_t *rng)
+{
+	double u = rng_double(rng);
+	double uz = u * z->zetan;
+	unsigned long res;
+
+	if (uz < 1)
+		return 0;
+	if (uz < 1 + pow(0.5, z->theta))
+		return 1;
+	res = (unsigned long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+	return res < z->n ? res : z->n - 1;
+}
+
+static unsigned long next_key_index(uint64_t *rng)
+{
+	if (cfg.zipf > 0)
+	{
+		// spread popular keys over the key space
+		return mix64(zipf_next(&zipf, rng)) % cfg.keys;
+	}
+	return rng_next(rng) % cfg.keys;
+}
+
+// key size depends only on the index, so every key is always the same
+// string: decimal index padded with 'k' to the size
+static int make_key(char *buf, unsigned long index)
+{
+	int size, len;
+
+	size = cfg.key_min + mix64(index) % (cfg.key_max - cfg.key_min + 1);
+	len = sprintf(buf, "%lu", index);
+	if (size > len)
+	{
+		memset(buf + len, 'k', size - len);
+		len = size;
+	}
+	return len;
+}
+
+static int make_value_size(uint64_t *rng)
+{
+	return cfg.value_min + rng_next(rng) % (cfg.value_max - cfg.value_min + 1);
+}
+
+static unsigned int hist_index(uint64_t ns)
+{
+	unsigned int msb;
+
+	if (ns < HIST_SUB)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+		((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// upper bound of the bucket values
+static uint64_t hist_value(unsigned int index)
+{
+	unsigned int shift;
+
+	if (index < HIST_SUB)
+		return index;
+	shift = index / HIST_SUB - 1;
+	return ((uint64_t)(HIST_SUB + index % HIST_SUB) << shift) + (1ULL << shift) - 1;
+}
+
+static uint64_t hist_percentile(const struct op_stats *s, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (s->count == 0)
+		return 0;
+	rank = (uint64_t)ceil(p * s->count);
+	if (rank == 0)
+		rank = 1;
+	for (i = 0; i < HIST_SIZE; i++)
+	{
+		seen += s->hist[i];
+		if (seen >= rank)
+			return hist_value(i);
+	}
+	return hist_value(HIST_SIZE - 1);
+}
+
+static enum op pick_op(uint64_t *rng)
+{
+	unsigned int total = 0, r, i;
+
+	for (i = 0; i < OP_COUNT; i++)
+		total += cfg.mix[i];
+	r = rng_next(rng) % total;
+	for (i = 0; i < OP_COUNT; i++)
+	{
+		if (r < cfg.mix[i])
+			return i;
+		r -= cfg.mix[i];
+	}
+	return OP_GET;
+}
+
+// missing keys for GET / DEL and existing keys for ADD are not errors for
+// a shared key space
+static int expected_error(enum op op, int err)
+{
+	return (err == ENOENT && (op == OP_GET || op == OP_DEL)) ||
+		(err == EEXIST && op == OP_ADD);
+}
+
+// returns 0 if the operation completed as expected, see expected_error()
+static int run_op(int fd, struct thread *t, enum op op)
+{
+	ko_test_node node;
+	int ret;
+
+	node.key = t->key;
+	node.key_size = make_key(t->key, next_key_index(&t->rng));
+	node.value = t->value;
+	switch (op)
+	{
+	case OP_GET:
+		node.value_size = cfg.value_max;
+		ret = ioctl(fd, KO_TEST_IOCTL_GET, &node);
+		break;
+	case OP_SET:
+		node.value_size = make_value_size(&t->rng);
+		ret = ioctl(fd, KO_TEST_IOCTL_SET, &node);
+		break;
+	case OP_ADD:
+		node.value_size = make_value_size(&t->rng);
+		ret = ioctl(fd, KO_TEST_IOCTL_ADD, &node);
+		break;
+	case OP_DEL:
+		ret = ioctl(fd, KO_TEST_IOCTL_DEL, &node);
+		break;
+	default:
+		return -1;
+	}
+	return ret == -1 && !expected_error(op, errno) ? -1 : 0;
+}
+
+static void record_op(struct thread *t, enum op op, int ret, uint64_t ns)
+{
+	struct op_stats *s = &t->stats[op];
+
+	s->count++;
+	if (ret != 0)
+		s->errors++;
+	s->hist[hist_index(ns)]++;
+}
+
+// every ring slot owns a key buffer followed by a value buffer
+static size_t ring_slot_size(void)
+{
+	return cfg.key_max + 24 + cfg.value_max;
+}
+
+static int ring_setup(int fd, struct ring *r)
+{
+	ko_test_ring_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.entries = cfg.ring_depth;
+	params.data_size = cfg.ring_depth * ring_slot_size();
+	params.flags = cfg.ring_poll ? KO_TEST_RING_POLL : 0;
+	if (ioctl(fd, KO_TEST_IOCTL_RING_SETUP, &params) == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_RING_SETUP");
+		return -1;
+	}
+	r->size = params.size;
+	r->mem = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (r->mem == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	r->header = r->mem;
+	r->sq = (ko_test_sqe *)((char *)r->mem + params.sq_offset);
+	r->cq = (ko_test_cqe *)((char *)r->mem + params.cq_offset);
+	r->data = (char *)r->mem + params.data_offset;
+	r->mask = cfg.ring_depth - 1;
+	memset(r->data, 'v', params.data_size);
+	r->ops = calloc(cfg.ring_depth, sizeof(enum op));
+	r->start = calloc(cfg.ring_depth, sizeof(uint64_t));
+	return 0;
+}
+
+static void ring_free(struct ring *r)
+{
+	munmap(r->mem, r->size);
+	free(r->ops);
+	free(r->start);
+}
+
+// the slot is also the user_data of the submission
+static void ring_submit(struct ring *r, struct thread *t, unsigned int slot)
+{
+	static const unsigned char opcodes[OP_COUNT] = {
+		KO_TEST_RING_GET, KO_TEST_RING_SET, KO_TEST_RING_ADD, KO_TEST_RING_DEL
+	};
+	unsigned int tail = r->header->sq_tail;
+	ko_test_sqe *sqe = &r->sq[tail & r->mask];
+	enum op op = pick_op(&t->rng);
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcodes[op];
+	sqe->key_offset = slot * ring_slot_size();
+	sqe->key_size = make_key(r->data + sqe->key_offset, next_key_index(&t->rng));
+	sqe->value_offset = sqe->key_offset + cfg.key_max + 24;
+	sqe->value_size = op == OP_GET ? cfg.value_max : make_value_size(&t->rng);
+	sqe->user_data = slot;
+	r->ops[slot] = op;
+	r->start[slot] = now_ns();
+	__atomic_store_n(&r->header->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// a polled ring only needs the doorbell when the worker went to sleep
+static int ring_enter(int fd, struct ring *r)
+{
+	if (cfg.ring_poll)
+	{
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!(__atomic_load_n(&r->header->flags, __ATOMIC_RELAXED) &
+			KO_TEST_RING_NEED_WAKEUP))
+			return 0;
+	}
+	if (ioctl(fd, KO_TEST_IOCTL_RING_ENTER) == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_RING_ENTER");
+		return -1;
+	}
+	return 0;
+}
+
+// keeps every slot in flight, a completed slot is submitted again until
+// the run stops. Latency is the time from submit to completion
+static void ring_loop(int fd, struct thread *t)
+{
+	unsigned int slot, head, tail, inflight = 0;
+	struct ring r;
+	int p, submitted;
+
+	if (ring_setup(fd, &r) != 0)
+		return;
+	for (slot = 0; slot < cfg.ring_depth; slot++)
+		ring_submit(&r, t, slot);
+	inflight = cfg.ring_depth;
+	submitted = 1;
+	while (inflight > 0)
+	{
+		if (submitted && ring_enter(fd, &r) != 0)
+			break;
+		submitted = 0;
+		p = __atomic_load_n(&phase, __ATOMIC_RELAXED);
+		head = r.header->cq_head;
+		tail = __atomic_load_n(&r.header->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			ko_test_cqe *cqe = &r.cq[head & r.mask];
+			enum op op;
+
+			slot = cqe->user_data;
+			op = r.ops[slot];
+			if (p == PHASE_MEASURE)
+				record_op(t, op, cqe->res != 0 && !expected_error(op, -cqe->res) ? -1 : 0,
+					now_ns() - r.start[slot]);
+			if (p == PHASE_STOP)
+				inflight--;
+			else
+			{
+				ring_submit(&r, t, slot);
+				submitted = 1;
+			}
+		}
+		__atomic_store_n(&r.header->cq_head, head, __ATOMIC_RELEASE);
+	}
+	ring_free(&r);
+}
+
+static void *thread_main(void *arg)
+{
+	struct thread *t = arg;
+	uint64_t start, end;
+	enum op op;
+	int fd, ret, p;
+
+	fd = open(cfg.dev, O_RDWR);
+	if (fd == -1)
+	{
+		perror("open");
+		return NULL;
+	}
+	if (cfg.ring_depth > 0)
+	{
+		ring_loop(fd, t);
+		close(fd);
+		return NULL;
+	}
+	while ((p = __atomic_load_n(&phase, __ATOMIC_RELAXED)) != PHASE_STOP)
+	{
+		op = pick_op(&t->rng);
+		start = now_ns();
+		ret = run_op(fd, t, op);
+		end = now_ns();
+		if (p == PHASE_MEASURE)
+			record_op(t, op, ret, end - start);
+	}
+	close(fd);
+	return NULL;
+}
+
+static int prefill(void)
+{
+	ko_test_node nodes[KO_TEST_MAX_BATCH];
+	int results[KO_TEST_MAX_BATCH];
+	ko_test_batch batch;
+	unsigned long i, base;
+	uint64_t rng = 1;
+	char *keys, *value;
+	int fd, ret = 0;
+
+	fd = open(cfg.dev, O_RDWR);
+	if (fd == -1)
+	{
+		perror("open");
+		return -1;
+	}
+	keys = malloc((size_t)KO_TEST_MAX_BATCH * (cfg.key_max + 24));
+	value = malloc(cfg.value_max);
+	memset(value, 'v', cfg.value_max);
+	for (base = 0; base < cfg.keys && ret == 0; base += KO_TEST_MAX_BATCH)
+	{
+		batch.count = 0;
+		for (i = base; i < cfg.keys && i < base + KO_TEST_MAX_BATCH; i++)
+		{
+			ko_test_node *node = &nodes[batch.count++];
+
+			node->key = keys + (i - base) * (cfg.key_max + 24);
+			node->key_size = make_key(node->key, i);
+			node->value = value;
+			node->value_size = make_value_size(&rng);
+		}
+		batch.nodes = nodes;
+		batch.results = results;
+		ret = ioctl(fd, KO_TEST_IOCTL_MSET, &batch);
+		if (ret == -1)
+			perror("ioctl - KO_TEST_IOCTL_MSET");
+	}
+	free(keys);
+	free(value);
+	close(fd);
+	return ret;
+}
+
+static void sleep_seconds(double seconds)
+{
+	struct timespec tp;
+
+	tp.tv_sec = (time_t)seconds;
+	tp.tv_nsec = (long)((seconds - tp.tv_sec) * 1e9);
+	while (nanosleep(&tp, &tp) == -1 && errno == EINTR)
+		;
+}
+
+static void print_results(struct thread *threads, double elapsed)
+{
+	struct op_stats total;
+	uint64_t all = 0;
+	int op, i, j, first = 1;
+
+	printf("{\"threads\": %d, \"ring_depth\": %u, \"ring_poll\": %d, \"keys\": %lu, "
+		"\"zipf\": %.3f, \"duration_s\": %.3f, "
+		"\"key_size\": [%d, %d], \"value_size\": [%d, %d], \"ops\": {",
+		cfg.threads, cfg.ring_depth, cfg.ring_poll, cfg.keys, cfg.zipf, elapsed,
+		cfg.key_min, cfg.key_max, cfg.value_min, cfg.value_max);
+	for (op = 0; op < OP_COUNT; op++)
+	{
+		if (cfg.mix[op] == 0)
+			continue;
+		memset(&total, 0, sizeof(total));
+		for (i = 0; i < cfg.threads; i++)
+		{
+			total.count += threads[i].stats[op].count;
+			total.errors += threads[i].stats[op].errors;
+			for (j = 0; j < HIST_SIZE; j++)
+				total.hist[j] += threads[i].stats[op].hist[j];
+		}
+		all += total.count;
+		printf("%s\"%s\": {\"count\": %llu, \"errors\": %llu, \"ops_per_sec\": %.0f, "
+			"\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu}",
+			first ? "" : ", ", op_names[op],
+			(unsigned long long)total.count, (unsigned long long)total.errors,
+			total.count / elapsed,
+			(unsigned long long)hist_percentile(&total, 0.5),
+			(unsigned long long)hist_percentile(&total, 0.99),
+			(unsigned long long)hist_percentile(&total, 0.999));
+		first = 0;
+	}
+	printf("}, \"ops_per_sec\": %.0f}\n", all / elapsed);
+}
+
+static int parse_range(const char *arg, int *min, int *max)
+{
+	if (sscanf(arg, "%d:%d", min, max) == 2)
+		return *min > 0 && *min <= *max ? 0 : -1;
+	if (sscanf(arg, "%d", min) == 1)
+	{
+		*max = *min;
+		return *min > 0 ? 0 : -1;
+	}
+	return -1;
+}
+
+// "get=90,set=10", missing operations get zero weight
+static int parse_mix(char *arg)
+{
+	unsigned int total = 0, weight;
+	char *item, *save;
+	int op;
+
+	memset(cfg.mix, 0, sizeof(cfg.mix));
+	for (item = strtok_r(arg, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+	{
+		for (op = 0; op < OP_COUNT; op++)
+		{
+			size_t len = strlen(op_names[op]);
+
+			if (strncmp(item, op_names[op], len) == 0 && item[len] == '=')
+				break;
+		}
+		if (op == OP_COUNT || sscanf(strchr(item, '=') + 1, "%u", &weight) != 1)
+			return -1;
+		cfg.mix[op] = weight;
+		total += weight;
+	}
+	return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options]\n"
+		"  -D <path>      device, default %s\n"
+		"  -t <count>     threads, default %d\n"
+		"  -w <seconds>   warm-up, not measured, default %.0f\n"
+		"  -d <seconds>   measured run, default %.0f\n"
+		"  -n <count>     key space size, default %lu\n"
+		"  -k <min:max>   key size range, default %d:%d\n"
+		"  -v <min:max>   value size range, default %d:%d\n"
+		"  -m <mix>       operation weights, default get=90,set=10\n"
+		"                 operations: get, set, add, del\n"
+		"  -z <theta>     Zipfian key popularity (0 < theta < 1), default uniform\n"
+		"  -P             do not prefill the key space with MSET\n"
+		"  -R <depth>     run operations through the mmap rings, depth (a power\n"
+		"                 of two) of them in flight per thread, default ioctls\n"
+		"  -p             the rings are polled by a kernel worker\n",
+		name, DEFAULT_DEV, cfg.threads, cfg.warmup, cfg.duration, cfg.keys,
+		cfg.key_min, cfg.key_max, cfg.value_min, cfg.value_max);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *threads;
+	uint64_t start;
+	double elapsed;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "D:t:w:d:n:k:v:m:z:PR:ph")) != -1)
+	{
+		switch (opt)
+		{
+		case 'D':
+			cfg.dev = optarg;
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'w':
+			cfg.warmup = atof(optarg);
+			break;
+		case 'd':
+			cfg.duration = atof(optarg);
+			break;
+		case 'n':
+			cfg.keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			if (parse_range(optarg, &cfg.key_min, &cfg.key_max) != 0)
+			{
+				printf("bad key size range: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'v':
+			if (parse_range(optarg, &cfg.value_min, &cfg.value_max) != 0)
+			{
+				printf("bad value size range: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'm':
+			if (parse_mix(optarg) != 0)
+			{
+				printf("bad operation mix: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'z':
+			cfg.zipf = atof(optarg);
+			break;
+		case 'P':
+			cfg.prefill = 0;
+			break;
+		case 'R':
+			cfg.ring_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			cfg.ring_poll = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (cfg.threads < 1 || cfg.threads > MAX_THREADS || cfg.keys == 0 ||
+		cfg.duration <= 0 || cfg.warmup < 0 || cfg.zipf < 0 || cfg.zipf >= 1 ||
+		cfg.ring_depth > KO_TEST_RING_MAX_ENTRIES ||
+		(cfg.ring_depth & (cfg.ring_depth - 1)) != 0 ||
+		(cfg.ring_poll && cfg.ring_depth == 0))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (cfg.zipf > 0)
+		zipf_init(&zipf, cfg.keys, cfg.zipf);
+	if (cfg.prefill && prefill() != 0)
+		return EXIT_FAILURE;
+
+	threads = calloc(cfg.threads, sizeof(struct thread));
+	start = now_ns();
+	for (i = 0; i < cfg.threads; i++)
+	{
+		threads[i].rng = mix64(start + i) | 1;
+		threads[i].key = malloc(cfg.key_max + 24);
+		threads[i].value = malloc(cfg.value_max);
+		memset(threads[i].value, 'v', cfg.value_max);
+		if (pthread_create(&threads[i].id, NULL, thread_main, &threads[i]) != 0)
+		{
+			perror("pthread_create");
+			return EXIT_FAILURE;
+		}
+	}
+
+	sleep_seconds(cfg.warmup);
+	start = now_ns();
+	__atomic_store_n(&phase, PHASE_MEASURE, __ATOMIC_RELAXED);
+	sleep_seconds(cfg.duration);
+	__atomic_store_n(&phase, PHASE_STOP, __ATOMIC_RELAXED);
+	elapsed = (now_ns() - start) / 1e9;
+
+	for (i = 0; i < cfg.threads; i++)
+		pthread_join(threads[i].id, NULL);
+	print_results(threads, elapsed);
+
+	for (i = 0; i < cfg.threads; i++)
+	{
+		free(threads[i].key);
+		free(threads[i].value);
+	}
+	free(threads);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,470 @@
+// Single-threaded microbenchmarks of the hash table core built in user
+// space (../ht.c with ht_user.c), no module is needed. Every benchmark runs
+// over the same key set, results are printed as a single JSON object,
+// see usage()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ht.h"
+
+enum bench
+{
+	BENCH_INSERT,
+	BENCH_LOOKUP_HIT,
+	BENCH_LOOKUP_MISS,
+	BENCH_ITERATE_LOCKED,
+	BENCH_ITERATE_SCAN,
+	BENCH_ITERATE_RANGE,
+	BENCH_DELETE,
+	BENCH_LOAD,
+	BENCH_COUNT
+};
+
+static const char *bench_names[BENCH_COUNT] = {
+	"insert", "lookup_hit", "lookup_miss", "iterate_locked", "iterate_scan",
+	"iterate_range", "delete", "load"
+};
+
+struct config
+{
+	unsigned long keys;
+	int key_size;
+	int value_size;
+	unsigned int min_size;
+	const char *hash_function;
+	int rounds;
+	bool ordered;
+	// lookup backend, chain or open, see HT_OPEN
+	const char *backend;
+	unsigned int load_factor;
+};
+
+struct result
+{
+	uint64_t ops;
+	uint64_t errors;
+	uint64_t ns;
+};
+
+static struct config cfg = {
+	.keys = 1000000,
+	.key_size = 16,
+	.value_size = 64,
+	.min_size = 1024,
+	.hash_function = "siphash",
+	.rounds = 3,
+	.backend = "chain",
+	.load_factor = 100,
+};
+
+static char *keys;
+static char *missing_keys;
+static unsigned long *order;
+static char *value;
+// all keys in ko_test_record format, as a dump of the table would be
+static char *image;
+static size_t image_size;
+// table size with all keys inserted
+static unsigned int full_buckets;
+static struct ht table;
+
+static uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+// xorshift64*, state must not be zero
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// keys are "<prefix><index>" padded with '_' to key_size bytes
+static void make_key(char *key, char prefix, unsigned long index)
+{
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%c%lu", prefix, index);
+
+	memset(key, '_', cfg.key_size);
+	memcpy(key, buf, len < cfg.key_size ? len : cfg.key_size);
+}
+
+static char *key_at(char *base, unsigned long index)
+{
+	return base + index * cfg.key_size;
+}
+
+static int prepare(void)
+{
+	uint64_t rng = 0x9E3779B97F4A7C15ULL;
+	unsigned long i, j, tmp;
+
+	keys = malloc(cfg.keys * cfg.key_size);
+	missing_keys = malloc(cfg.keys * cfg.key_size);
+	order = malloc(cfg.keys * sizeof(unsigned long));
+	value = malloc(cfg.value_size + 1);
+	image_size = cfg.keys * KO_TEST_RECORD_SIZE(cfg.key_size, cfg.value_size);
+	image = calloc(1, image_size);
+	if (keys == NULL || missing_keys == NULL || order == NULL || value == NULL ||
+		image == NULL)
+		return -1;
+	memset(value, 'v', cfg.value_size + 1);
+	for (i = 0; i < cfg.keys; i++)
+	{
+		make_key(key_at(keys, i), 'k', i);
+		make_key(key_at(missing_keys, i), 'm', i);
+		order[i] = i;
+	}
+	// lookups and deletes visit the keys in random order, so the buckets
+	// are not touched in insertion order
+	for (i = cfg.keys - 1; i > 0; i--)
+	{
+		j = rng_next(&rng) % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (i = 0; i < cfg.keys; i++)
+	{
+		char *dst = image + i * KO_TEST_RECORD_SIZE(cfg.key_size, cfg.value_size);
+		ko_test_record rec = { cfg.key_size, cfg.value_size };
+
+		memcpy(dst, &rec, sizeof(rec));
+		memcpy(dst + sizeof(rec), key_at(keys, order[i]), cfg.key_size);
+		memcpy(dst + sizeof(rec) + cfg.key_size, value, cfg.value_size);
+	}
+	return 0;
+}
+
+// resize runs in the background after inserts and deletes, lookups are
+// measured on the final table
+static void wait_resize(void)
+{
+	int i;
+
+	for (i = 0; i < 10000; i++)
+	{
+		unsigned long count = ht_item_count(&table), size = ht_bucket_count(&table);
+
+		if (count * 100 <= (unsigned long)ht_max_load_factor * size &&
+			(count * 800 >= (unsigned long)ht_max_load_factor * size ||
+			size <= cfg.min_size * 2))
+			return;
+		usleep(1000);
+	}
+}
+
+static void run_insert(struct result *res)
+{
+	ko_test_node node = { .key_size = cfg.key_size, .value = value,
+		.value_size = cfg.value_size };
+	unsigned long i;
+
+	for (i = 0; i < cfg.keys; i++)
+	{
+		node.key = key_at(keys, i);
+		if (ht_add_item(&table, &node, false, 0) != 0)
+			res->errors++;
+	}
+	res->ops = cfg.keys;
+}
+
+static void run_lookup(struct result *res, char *base)
+{
+	struct ht_item *item;
+	unsigned long i, found = 0;
+
+	for (i = 0; i < cfg.keys; i++)
+	{
+		rcu_read_lock();
+		item = ht_lookup(&table, key_at(base, order[i]), cfg.key_size);
+		if (item != NULL)
+			found++;
+		rcu_read_unlock();
+	}
+	res->ops = cfg.keys;
+	res->errors = base == keys ? cfg.keys - found : found;
+}
+
+static void run_iterate_locked(struct result *res)
+{
+	struct ht_item *item;
+	unsigned long count = 0;
+	int bkt;
+
+	if (!ht_lock_writes(&table))
+	{
+		res->errors = 1;
+		return;
+	}
+	for (item = ht_read_init(&table, &bkt, &item); item != NULL; item = ht_read_next(&table, &bkt, &item))
+		count++;
+	ht_unlock_writes(&table);
+	res->ops = count;
+	res->errors = count != cfg.keys;
+}
+
+static void run_iterate_scan(struct result *res)
+{
+	static char buf[64 * 1024];
+	unsigned long pos = 0, count = 0;
+	size_t used, offset;
+	bool done = false;
+
+	while (!done)
+	{
+		if (ht_scan(&table, &pos, &done, buf, sizeof(buf), &used) != 0)
+		{
+			res->errors = 1;
+			break;
+		}
+		for (offset = 0; offset < used; count++)
+		{
+			ko_test_record *rec = (ko_test_record *)(buf + offset);
+
+			offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+		}
+	}
+	res->ops = count;
+	res->errors += count != cfg.keys;
+}
+
+// the whole table in key order, only with -o
+static void run_iterate_range(struct result *res)
+{
+	static char buf[64 * 1024];
+	struct ht_range range = { };
+	unsigned long count = 0;
+	size_t used, offset;
+
+	if (!cfg.ordered)
+		return;
+	while (!range.done)
+	{
+		if (ht_range_scan(&table, &range, buf, sizeof(buf), &used) != 0)
+		{
+			res->errors = 1;
+			break;
+		}
+		for (offset = 0; offset < used; count++)
+		{
+			ko_test_record *rec = (ko_test_record *)(buf + offset);
+
+			offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+		}
+	}
+	ht_range_free(&range);
+	res->ops = count;
+	res->errors += count != cfg.keys;
+}
+
+static void run_delete(struct result *res)
+{
+	unsigned long i;
+
+	for (i = 0; i < cfg.keys; i++)
+		if (ht_del_item(&table, key_at(keys, order[i]), cfg.key_size) != 0)
+			res->errors++;
+	res->ops = cfg.keys;
+}
+
+// trusted bulk load of the image into the empty table, the table is sized
+// for it at once
+static void run_load(struct result *res)
+{
+	ko_test_node node = { .key_size = cfg.key_size, .value_size = cfg.value_size };
+	size_t offset;
+
+	ht_load_begin(&table, cfg.keys);
+	for (offset = 0; offset < image_size;
+		offset += KO_TEST_RECORD_SIZE(cfg.key_size, cfg.value_size))
+	{
+		node.key = image + offset + sizeof(ko_test_record);
+		node.value = node.key + cfg.key_size;
+		if (ht_load_item(&table, &node, true) != 0)
+			res->errors++;
+	}
+	ht_load_end(&table);
+	res->ops = cfg.keys;
+}
+
+static void run(enum bench bench, struct result *res)
+{
+	uint64_t start = now_ns();
+
+	switch (bench)
+	{
+	case BENCH_INSERT:
+		run_insert(res);
+		break;
+	case BENCH_LOOKUP_HIT:
+		run_lookup(res, keys);
+		break;
+	case BENCH_LOOKUP_MISS:
+		run_lookup(res, missing_keys);
+		break;
+	case BENCH_ITERATE_LOCKED:
+		run_iterate_locked(res);
+		break;
+	case BENCH_ITERATE_SCAN:
+		run_iterate_scan(res);
+		break;
+	case BENCH_ITERATE_RANGE:
+		run_iterate_range(res);
+		break;
+	case BENCH_DELETE:
+		run_delete(res);
+		break;
+	case BENCH_LOAD:
+		run_load(res);
+		break;
+	default:
+		break;
+	}
+	res->ns = now_ns() - start;
+	// the next round starts with an empty table
+	if (bench == BENCH_LOAD)
+	{
+		struct result del = { 0 };
+
+		run_delete(&del);
+		res->errors += del.errors;
+	}
+	if (bench == BENCH_INSERT || bench == BENCH_DELETE || bench == BENCH_LOAD)
+		wait_resize();
+	if (bench == BENCH_INSERT)
+		full_buckets = ht_bucket_count(&table);
+}
+
+static void print_results(struct result results[BENCH_COUNT])
+{
+	int bench;
+
+	printf("{\"keys\": %lu, \"key_size\": %d, \"value_size\": %d, \"min_size\": %u, "
+		"\"hash_function\": \"%s\", \"backend\": \"%s\", \"load_factor\": %u, \"rounds\": %d, "
+		"\"ordered\": %s, \"buckets\": %u, \"results\": {",
+		cfg.keys, cfg.key_size, cfg.value_size, cfg.min_size, cfg.hash_function,
+		cfg.backend, cfg.load_factor, cfg.rounds, cfg.ordered ? "true" : "false", full_buckets);
+	for (bench = 0; bench < BENCH_COUNT; bench++)
+	{
+		struct result *res = &results[bench];
+
+		printf("%s\"%s\": {\"ops\": %llu, \"errors\": %llu, \"ns_per_op\": %.1f, "
+			"\"ops_per_sec\": %.0f}",
+			bench == 0 ? "" : ", ", bench_names[bench],
+			(unsigned long long)res->ops, (unsigned long long)res->errors,
+			res->ops ? (double)res->ns / res->ops : 0,
+			res->ns ? res->ops * 1e9 / res->ns : 0);
+	}
+	printf("}}\n");
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options]\n"
+		"  -n <count>     keys, default %lu\n"
+		"  -k <size>      key size, default %d\n"
+		"  -v <size>      value size, default %d\n"
+		"  -s <buckets>   initial and minimal table size, default %u\n"
+		"  -H <name>      hash function, siphash or djb2, default %s\n"
+		"  -B <name>      lookup backend, chain or open, default %s\n"
+		"  -L <factor>    max load factor, items per 100 buckets, default %u\n"
+		"  -r <count>     rounds, the best one is reported, default %d\n"
+		"  -o             keep the ordered index, iterate_range runs only with it\n",
+		name, cfg.keys, cfg.key_size, cfg.value_size, cfg.min_size,
+		cfg.hash_function, cfg.backend, cfg.load_factor, cfg.rounds);
+}
+
+int main(int argc, char **argv)
+{
+	struct result best[BENCH_COUNT], res;
+	int opt, round, bench;
+
+	while ((opt = getopt(argc, argv, "n:k:v:s:H:B:L:r:oh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			cfg.keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			cfg.key_size = atoi(optarg);
+			break;
+		case 'v':
+			cfg.value_size = atoi(optarg);
+			break;
+		case 's':
+			cfg.min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			cfg.hash_function = optarg;
+			break;
+		case 'B':
+			cfg.backend = optarg;
+			break;
+		case 'L':
+			cfg.load_factor = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			cfg.rounds = atoi(optarg);
+			break;
+		case 'o':
+			cfg.ordered = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	// every key must be unique
+	if (cfg.keys == 0 || cfg.key_size < 12 || cfg.value_size < 0 || cfg.rounds < 1 ||
+		cfg.load_factor == 0 ||
+		(strcmp(cfg.backend, "chain") != 0 && strcmp(cfg.backend, "open") != 0))
+	{
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (prepare() != 0)
+	{
+		printf("out of memory\n");
+		return EXIT_FAILURE;
+	}
+	ht_max_load_factor = cfg.load_factor;
+	if (ht_init(&table, cfg.min_size, cfg.hash_function,
+		(cfg.ordered ? HT_ORDERED : 0) |
+		(strcmp(cfg.backend, "open") == 0 ? HT_OPEN : 0), NULL) != 0)
+		return EXIT_FAILURE;
+
+	memset(best, 0, sizeof(best));
+	for (round = 0; round < cfg.rounds; round++)
+	{
+		for (bench = 0; bench < BENCH_COUNT; bench++)
+		{
+			memset(&res, 0, sizeof(res));
+			run(bench, &res);
+			if (round == 0 || res.ns < best[bench].ns)
+				best[bench] = res;
+		}
+	}
+	print_results(best);
+
+	ht_destroy(&table);
+	free(keys);
+	free(missing_keys);
+	free(order);
+	free(value);
+	free(image);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,1230 @@
+// Fuzz and stress harness of the hash table core built in user space.
+//
+// Fuzzing: every input is decoded into a stream of operations on a small
+// key space, which are applied both to the table and to a trivial model,
+// results and full iterations are compared. The table starts with two
+// buckets, so resizes run in the background all the time. Built with
+// -DHT_LIBFUZZER it is a libFuzzer target, otherwise main() replays the
+// files given or runs random inputs. Items with a TTL expire when the
+// clock of the table is moved forward by FUZZ_ADVANCE.
+//
+// Stress (-s): writer threads own disjoint key ranges, reader and scan
+// threads check that every value they see is consistent. With a memory
+// budget (-b) or a TTL (-T) items disappear meanwhile, see usage()
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ht.h"
+
+#define FUZZ_KEYS 64
+#define FUZZ_MAX_VALUE 4096
+// slab object or page of the value plus the item itself
+#define FUZZ_MAX_ITEM_BYTES (3 * FUZZ_MAX_VALUE)
+// small enough for ht_scan to ask for a larger buffer now and then
+#define SCAN_BUF_SIZE 4096
+
+#define check(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			abort(); \
+		} \
+	} while (0)
+
+enum fuzz_op
+{
+	FUZZ_ADD,
+	FUZZ_SET,
+	FUZZ_DEL,
+	FUZZ_GET,
+	FUZZ_SCAN,
+	FUZZ_READ_LOCKED,
+	FUZZ_BAD_KEY,
+	FUZZ_EVICT,
+	FUZZ_ADVANCE,
+	FUZZ_EXPIRE,
+	FUZZ_LOAD,
+	FUZZ_CAS,
+	FUZZ_INCR,
+	FUZZ_APPEND,
+	FUZZ_RANGE,
+	FUZZ_OP_COUNT
+};
+
+// TTLs are FUZZ_TTL_STEP multiples plus a half step and the clock moves by
+// whole steps, so the real time an input runs does not change the result
+#define FUZZ_TTL_STEP 100
+
+struct model_item
+{
+	// linked into the table, maybe expired and not reclaimed yet
+	bool present;
+	// model clock in seconds the item expires at, 0 if never
+	uint64_t expires;
+	// last version seen, versions of a key never go back
+	uint64_t version;
+	int value_size;
+	char value[FUZZ_MAX_VALUE];
+};
+
+static struct model_item model[FUZZ_KEYS];
+// seconds the table clock has been moved forward by
+static uint64_t model_clock;
+static struct ht table;
+// holds one key of the same name as in table, which no operation on
+// table may touch
+static struct ht other;
+
+// value sizes cover empty, inline and separately allocated values
+static const int value_sizes[] = { 0, 1, 7, 100, 900, 1024, 1500, FUZZ_MAX_VALUE };
+
+static uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+// xorshift64*, state must not be zero
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// key sizes differ, so keys of different sizes share the same prefix
+static int make_key(char *key, unsigned int index)
+{
+	int size = snprintf(key, 16, "k%u", index % 16);
+
+	memset(key + size, '.', index / 16);
+	return size + index / 16;
+}
+
+// reverse of make_key, -1 for foreign keys
+static int model_index(const char *key, int size)
+{
+	char buf[32];
+	int index, dots;
+
+	if (size < 2 || size > 16 || key[0] != 'k')
+		return -1;
+	for (dots = 0; dots < size && key[size - 1 - dots] == '.'; dots++)
+		;
+	memcpy(buf, key + 1, size - 1 - dots);
+	buf[size - 1 - dots] = 0;
+	if (sscanf(buf, "%d", &index) != 1 || index < 0 || index >= 16)
+		return -1;
+	index += dots * 16;
+	if (index >= FUZZ_KEYS || make_key(buf, index) != size || memcmp(buf, key, size) != 0)
+		return -1;
+	return index;
+}
+
+static bool model_live(const struct model_item *mi)
+{
+	return mi->present && (mi->expires == 0 || model_clock < mi->expires);
+}
+
+// expired items are counted until they are reclaimed
+static void check_count(void)
+{
+	int live = 0, present = 0, count = ht_item_count(&table), i;
+
+	for (i = 0; i < FUZZ_KEYS; i++)
+	{
+		live += model_live(&model[i]);
+		present += model[i].present;
+	}
+	check(count >= live && count <= present);
+}
+
+// input reader, returns zeroes when the data is over
+struct input
+{
+	const uint8_t *data;
+	size_t size;
+};
+
+static uint8_t input_byte(struct input *in)
+{
+	if (in->size == 0)
+		return 0;
+	in->size--;
+	return *in->data++;
+}
+
+static void check_item(const struct ht_item *item)
+{
+	int index = model_index(item->key, item->key_size);
+
+	check(index >= 0);
+	check(model_live(&model[index]));
+	check(item->version >= model[index].version);
+	check(item->value_size == model[index].value_size);
+	check(memcmp(item->value, model[index].value, item->value_size) == 0);
+}
+
+// current version of the key, 0 if it is missing
+static uint64_t item_version(const char *key, int size)
+{
+	struct ht_item *item = ht_get_item(&table, key, size);
+	uint64_t version = 0;
+
+	if (item != NULL)
+	{
+		version = item->version;
+		ht_item_put(item);
+	}
+	return version;
+}
+
+// new value of a successful update, which keeps the TTL
+static void model_update(struct model_item *mi, const char *value, int size,
+	uint64_t version)
+{
+	check(version > mi->version);
+	mi->version = version;
+	if (!model_live(mi))
+	{
+		mi->present = true;
+		mi->expires = 0;
+	}
+	memmove(mi->value, value, size);
+	mi->value_size = size;
+}
+
+// decimal number as ht_incr_item parses it
+static int model_number(const struct model_item *mi, int64_t *number)
+{
+	char buf[32], *end;
+
+	if (mi->value_size >= 24)
+		return -EINVAL;
+	memcpy(buf, mi->value, mi->value_size);
+	buf[mi->value_size] = 0;
+	end = buf[0] == '+' || buf[0] == '-' ? buf + 1 : buf;
+	if (*end < '0' || *end > '9')
+		return -EINVAL;
+	errno = 0;
+	*number = strtoll(buf, &end, 10);
+	if (errno == ERANGE)
+		return -ERANGE;
+	if (*end == '\n')
+		end++;
+	return *end == 0 ? 0 : -EINVAL;
+}
+
+// sel selects the compares: bit 0 the version, bit 1 whether it matches,
+// bit 2 the value, bit 3 whether it matches, the rest the new value size
+static void fuzz_cas(ko_test_node *node, struct model_item *mi, uint8_t sel)
+{
+	char expected[FUZZ_MAX_VALUE + 1];
+	uint64_t current, version = 0;
+	int expected_size = 0, res, i;
+	bool match = true;
+
+	current = item_version(node->key, node->key_size);
+	check(model_live(mi) == (current != 0));
+	if (sel & 1)
+	{
+		version = sel & 2 ? current : current + 1;
+		match = sel & 2;
+	}
+	if (sel & 4)
+	{
+		memcpy(expected, mi->value, mi->value_size);
+		expected_size = mi->value_size;
+		// one more byte, so it never matches
+		if (!(sel & 8))
+			expected[expected_size++] = 'x';
+		match = match && (sel & 8);
+	}
+	node->value_size = value_sizes[(sel >> 4) % ARRAY_SIZE(value_sizes)];
+	for (i = 0; i < node->value_size; i++)
+		node->value[i] = sel + i;
+	res = ht_cas_item(&table, node, sel & 4 ? expected : NULL, expected_size, &version);
+	if (current == 0)
+		check(res == -ENOENT);
+	else if (!match)
+		check(res == -ECANCELED && version == current);
+	else
+	{
+		check(res == 0);
+		model_update(mi, node->value, node->value_size, version);
+	}
+}
+
+static void fuzz_incr(ko_test_node *node, struct model_item *mi, uint8_t sel)
+{
+	int64_t delta = sel & 1 ? INT64_MAX : (int8_t)sel >> 1, value = 0, result;
+	uint64_t version;
+	char buf[32];
+	int res, expected = 0;
+
+	if (model_live(mi))
+		expected = model_number(mi, &value);
+	if (expected == 0 && __builtin_add_overflow(value, delta, &value))
+		expected = -ERANGE;
+	res = ht_incr_item(&table, node->key, node->key_size, delta, &result, &version);
+	check(res == expected);
+	if (res == 0)
+	{
+		check(result == value);
+		model_update(mi, buf, sprintf(buf, "%lld", (long long)value), version);
+	}
+}
+
+// appends that would not fit the model are skipped
+static void fuzz_append(ko_test_node *node, struct model_item *mi, uint8_t sel)
+{
+	char value[FUZZ_MAX_VALUE];
+	int size = 0, i;
+	uint64_t version;
+
+	node->value_size = value_sizes[sel % 4];
+	if (model_live(mi))
+	{
+		if (mi->value_size + node->value_size > FUZZ_MAX_VALUE)
+			return;
+		memcpy(value, mi->value, mi->value_size);
+		size = mi->value_size;
+	}
+	for (i = 0; i < node->value_size; i++)
+		node->value[i] = value[size++] = sel + i;
+	check(ht_append_item(&table, node, &version) == 0);
+	model_update(mi, value, size, version);
+}
+
+// every model item must be returned exactly once
+static void check_seen(const int *seen)
+{
+	int i;
+
+	for (i = 0; i < FUZZ_KEYS; i++)
+		check(seen[i] == (model_live(&model[i]) ? 1 : 0));
+}
+
+// next part of a scan, the buffer grows when a bucket does not fit it
+static size_t scan_next(unsigned long *pos, bool *done, char **buf, size_t *size)
+{
+	size_t used, need;
+
+	while ((need = ht_scan(&table, pos, done, *buf, *size, &used)) != 0)
+	{
+		check(need > *size);
+		*buf = realloc(*buf, need);
+		check(*buf != NULL);
+		*size = need;
+	}
+	return used;
+}
+
+static void fuzz_scan(void)
+{
+	static char *buf;
+	static size_t size;
+	int seen[FUZZ_KEYS] = { 0 };
+	unsigned long pos = 0;
+	size_t used, offset;
+	bool done = false;
+
+	while (!done)
+	{
+		used = scan_next(&pos, &done, &buf, &size);
+		for (offset = 0; offset < used; )
+		{
+			ko_test_record *rec = (ko_test_record *)(buf + offset);
+			char *key = buf + offset + sizeof(ko_test_record);
+			int index = model_index(key, rec->key_size);
+
+			check(index >= 0 && model_live(&model[index]));
+			check(rec->value_size == model[index].value_size);
+			check(memcmp(key + rec->key_size, model[index].value, rec->value_size) == 0);
+			seen[index]++;
+			offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+		}
+	}
+	check_seen(seen);
+}
+
+// order of the index, see ht_range
+static int key_cmp(const char *a, int a_size, const char *b, int b_size)
+{
+	int res = memcmp(a, b, min(a_size, b_size));
+
+	return res != 0 ? res : a_size - b_size;
+}
+
+static bool key_in_range(const struct ht_range *range, const char *key, int size)
+{
+	if (range->from != NULL && key_cmp(key, size, range->from, range->from_size) < 0)
+		return false;
+	if (range->to == NULL)
+		return true;
+	if (range->prefix)
+		return size >= range->to_size && memcmp(key, range->to, range->to_size) == 0;
+	return key_cmp(key, size, range->to, range->to_size) < 0;
+}
+
+// a prefix of a model key or a range between two model keys, either end
+// may be missing. The read must return the live keys of the range once
+// each and in order
+static void fuzz_range(uint8_t arg, uint8_t sel)
+{
+	static char *buf;
+	static size_t size;
+	struct ht_range range = { };
+	struct ht_range check_range;
+	char from[32], to[32], last[32];
+	int seen[FUZZ_KEYS] = { 0 }, last_size = -1, index, i;
+	size_t used, offset;
+	long need;
+
+	if (!table.ordered)
+		return;
+	if (sel & 1)
+		range.from_size = make_key(from, arg % FUZZ_KEYS);
+	if (sel & 2)
+	{
+		// prefixes are cut from the start key, to an empty one at most
+		range.prefix = true;
+		range.from_size = make_key(from, arg % FUZZ_KEYS);
+		range.from_size -= sel / 4 % (range.from_size + 1);
+		memcpy(to, from, range.from_size);
+		range.to_size = range.from_size;
+	}
+	else if (sel & 4)
+		range.to_size = make_key(to, sel / 8 % FUZZ_KEYS);
+	// the range owns copies of the ends
+	if (sel & 3)
+	{
+		range.from = malloc(range.from_size + 1);
+		check(range.from != NULL);
+		memcpy(range.from, from, range.from_size);
+	}
+	if (sel & 6)
+	{
+		range.to = malloc(range.to_size + 1);
+		check(range.to != NULL);
+		memcpy(range.to, to, range.to_size);
+	}
+	check_range = range;
+	check_range.from = from;
+	check_range.to = to;
+	if (!(sel & 3))
+		check_range.from = NULL;
+	if (!(sel & 6))
+		check_range.to = NULL;
+
+	while (!range.done)
+	{
+		while ((need = ht_range_scan(&table, &range, buf, size, &used)) != 0)
+		{
+			check(need > 0 && (size_t)need > size);
+			buf = realloc(buf, need);
+			check(buf != NULL);
+			size = need;
+		}
+		check(used != 0 || range.done);
+		for (offset = 0; offset < used; )
+		{
+			ko_test_record *rec = (ko_test_record *)(buf + offset);
+			char *key = buf + offset + sizeof(ko_test_record);
+
+			index = model_index(key, rec->key_size);
+			check(index >= 0 && model_live(&model[index]));
+			check(key_in_range(&check_range, key, rec->key_size));
+			check(last_size < 0 || key_cmp(last, last_size, key, rec->key_size) < 0);
+			check(rec->value_size == model[index].value_size);
+			check(memcmp(key + rec->key_size, model[index].value, rec->value_size) == 0);
+			memcpy(last, key, rec->key_size);
+			last_size = rec->key_size;
+			seen[index]++;
+			offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+		}
+	}
+	ht_range_free(&range);
+	for (i = 0; i < FUZZ_KEYS; i++)
+	{
+		last_size = make_key(last, i);
+		if (!key_in_range(&check_range, last, last_size))
+			check(seen[i] == 0);
+		else
+			check(seen[i] == (model_live(&model[i]) ? 1 : 0));
+	}
+}
+
+static void fuzz_read_locked(void)
+{
+	ko_test_node node = { .key = "locked", .key_size = 6, .value_size = 0 };
+	int seen[FUZZ_KEYS] = { 0 };
+	struct ht_item *item;
+	int bkt;
+
+	check(ht_lock_writes(&table));
+	check(!ht_lock_writes(&table));
+	check(ht_add_item(&table, &node, true, 0) == -EAGAIN);
+	check(ht_del_item(&table, "k0", 2) == -EAGAIN);
+	for (item = ht_read_init(&table, &bkt, &item); item != NULL; item = ht_read_next(&table, &bkt, &item))
+	{
+		check_item(item);
+		seen[model_index(item->key, item->key_size)]++;
+	}
+	ht_unlock_writes(&table);
+	check_seen(seen);
+}
+
+// evicted keys are dropped from the model. Expired ones may be evicted
+// or not, they stay until FUZZ_EXPIRE
+static void fuzz_evict(uint8_t arg)
+{
+	unsigned long used = ht_memory_used(&table), target;
+	struct ht_item *item;
+	char key[32];
+	int i;
+
+	if (arg & 1)
+		ht_shrink(&table, arg / 2 + 1);
+	else
+	{
+		ht_max_bytes = used / 2;
+		target = ht_max_bytes - ht_max_bytes / 16;
+		ht_check_budget(&table);
+		// eviction stops at the first item that brings the table under
+		// the target
+		check(ht_memory_used(&table) <= target);
+		check(ht_memory_used(&table) + FUZZ_MAX_ITEM_BYTES > target);
+		ht_max_bytes = 0;
+	}
+	check(ht_memory_used(&table) <= used);
+	for (i = 0; i < FUZZ_KEYS; i++)
+	{
+		if (!model_live(&model[i]))
+			continue;
+		item = ht_get_item(&table, key, make_key(key, i));
+		if (item == NULL)
+		{
+			model[i].present = false;
+			continue;
+		}
+		check_item(item);
+		ht_item_put(item);
+	}
+}
+
+// every expired item must be reclaimed by a full sweep
+static void fuzz_expire(void)
+{
+	int live = 0, i;
+
+	ht_expire_all(&table);
+	for (i = 0; i < FUZZ_KEYS; i++)
+	{
+		if (!model_live(&model[i]))
+			model[i].present = false;
+		live += model[i].present;
+	}
+	check(ht_item_count(&table) == live);
+}
+
+// dumps the table with ht_scan, deletes the keys and loads the image
+// back, trusted or not. Untrusted images may be loaded over the keys
+// present, they are replaced then. Loaded items have no TTL
+static void fuzz_load(uint8_t arg)
+{
+	static char *buf, *image;
+	static size_t size, image_size;
+	bool trusted = arg & 1, done = false;
+	unsigned long pos = 0;
+	size_t used, offset = 0, image_used = 0;
+	unsigned int count = 0;
+	int i;
+
+	while (!done)
+	{
+		used = scan_next(&pos, &done, &buf, &size);
+		if (used == 0)
+			continue;
+		if (image_used + used > image_size)
+		{
+			image_size = (image_used + used) * 2;
+			image = realloc(image, image_size);
+			check(image != NULL);
+		}
+		memcpy(image + image_used, buf, used);
+		image_used += used;
+	}
+	if (trusted || !(arg & 2))
+	{
+		for (i = 0; i < FUZZ_KEYS; i++)
+		{
+			char key[32];
+
+			if (model_live(&model[i]))
+				check(ht_del_item(&table, key, make_key(key, i)) == 0);
+		}
+	}
+	ht_load_begin(&table, arg & 4 ? 0 : 2 * FUZZ_KEYS);
+	while (offset < image_used)
+	{
+		ko_test_record *rec = (ko_test_record *)(image + offset);
+		ko_test_node node = { .key = image + offset + sizeof(ko_test_record),
+			.key_size = rec->key_size, .value_size = rec->value_size };
+
+		node.value = node.key + node.key_size;
+		check(ht_load_item(&table, &node, trusted) == 0);
+		offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+		count++;
+	}
+	ht_load_end(&table);
+	for (i = 0; i < FUZZ_KEYS; i++)
+	{
+		if (model_live(&model[i]))
+		{
+			model[i].expires = 0;
+			count--;
+		}
+	}
+	check(count == 0);
+}
+
+static void fuzz_op(struct input *in)
+{
+	char key[32], value[FUZZ_MAX_VALUE];
+	ko_test_node node = { .key = key, .value = value };
+	struct model_item *mi;
+	struct ht_item *item;
+	uint8_t op = input_byte(in), arg = input_byte(in), sel;
+	int index = arg % FUZZ_KEYS, res, i;
+	unsigned int ttl;
+
+	node.key_size = make_key(key, index);
+	mi = &model[index];
+	switch (op % FUZZ_OP_COUNT)
+	{
+	case FUZZ_ADD:
+	case FUZZ_SET:
+		// the same byte selects the value size and the TTL in steps
+		sel = input_byte(in);
+		node.value_size = value_sizes[sel % ARRAY_SIZE(value_sizes)];
+		ttl = sel / ARRAY_SIZE(value_sizes) % 4;
+		ttl = ttl != 0 ? ttl * FUZZ_TTL_STEP + FUZZ_TTL_STEP / 2 : 0;
+		for (i = 0; i < node.value_size; i++)
+			value[i] = op + arg + i;
+		res = ht_add_item(&table, &node, op % FUZZ_OP_COUNT == FUZZ_SET, ttl * 1000);
+		// an expired key is reclaimed and added again
+		if (model_live(mi) && op % FUZZ_OP_COUNT == FUZZ_ADD)
+		{
+			check(res == -EEXIST);
+			break;
+		}
+		check(res == 0);
+		mi->present = true;
+		mi->expires = ttl != 0 ? model_clock + ttl : 0;
+		mi->value_size = node.value_size;
+		memcpy(mi->value, value, node.value_size);
+		break;
+	case FUZZ_DEL:
+		res = ht_del_item(&table, key, node.key_size);
+		check(res == (model_live(mi) ? 0 : -ENOENT));
+		mi->present = false;
+		break;
+	case FUZZ_GET:
+		item = ht_get_item(&table, key, node.key_size);
+		check((item != NULL) == model_live(mi));
+		if (item != NULL)
+		{
+			check_item(item);
+			mi->version = item->version;
+			ht_item_put(item);
+		}
+		break;
+	case FUZZ_SCAN:
+		fuzz_scan();
+		break;
+	case FUZZ_READ_LOCKED:
+		fuzz_read_locked();
+		break;
+	case FUZZ_BAD_KEY:
+		// no model key starts with it, so the key is always new
+		key[0] = '\n';
+		node.value_size = 0;
+		check(ht_add_item(&table, &node, true, 0) == -EINVAL);
+		break;
+	case FUZZ_EVICT:
+		fuzz_evict(arg);
+		break;
+	case FUZZ_ADVANCE:
+		ktime_advance((uint64_t)(arg % 4) * FUZZ_TTL_STEP * 1000000000);
+		model_clock += (arg % 4) * FUZZ_TTL_STEP;
+		break;
+	case FUZZ_EXPIRE:
+		fuzz_expire();
+		break;
+	case FUZZ_LOAD:
+		fuzz_load(arg);
+		break;
+	case FUZZ_CAS:
+		fuzz_cas(&node, mi, input_byte(in));
+		break;
+	case FUZZ_INCR:
+		fuzz_incr(&node, mi, input_byte(in));
+		break;
+	case FUZZ_APPEND:
+		fuzz_append(&node, mi, input_byte(in));
+		break;
+	case FUZZ_RANGE:
+		fuzz_range(arg, input_byte(in));
+		break;
+	}
+	check_count();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	struct input in = { data, size };
+	ko_test_node node = { .value = "other", .value_size = 5 };
+	struct ht_item *item;
+	char key[32];
+	int i;
+
+	memset(model, 0, sizeof(model));
+	model_clock = 0;
+	// the first byte selects the hash function, the table flags and
+	// whether mid-sized values are paged
+	ht_paged_value_min = size > 0 && data[0] & 8 ? 900 : 0;
+	check(ht_init(&table, 2, size > 0 && data[0] & 1 ? "djb2" : "siphash",
+		(size > 0 && data[0] & 2 ? HT_ORDERED : 0) |
+		(size > 0 && data[0] & 4 ? HT_OPEN : 0), NULL) == 0);
+	check(ht_init(&other, 2, "siphash", HT_ORDERED | HT_OPEN, NULL) == 0);
+	node.key = key;
+	node.key_size = make_key(key, 0);
+	check(ht_add_item(&other, &node, false, 0) == 0);
+	while (in.size > 0)
+		fuzz_op(&in);
+	fuzz_scan();
+	fuzz_read_locked();
+	// memory accounting must get back to zero
+	for (i = 0; i < FUZZ_KEYS; i++)
+		if (model_live(&model[i]))
+			check(ht_del_item(&table, key, make_key(key, i)) == 0);
+	ht_expire_all(&table);
+	check(ht_item_count(&table) == 0 && ht_memory_used(&table) == 0);
+	ht_destroy(&table);
+	item = ht_get_item(&other, key, make_key(key, 0));
+	check(item != NULL && item->value_size == 5 && memcmp(item->value, "other", 5) == 0);
+	ht_item_put(item);
+	check(ht_item_count(&other) == 1);
+	ht_destroy(&other);
+	return 0;
+}
+
+#ifndef HT_LIBFUZZER
+
+// "Ab" and "BA" have the same djb2 hash, so do all keys built of n such
+// blocks. Two groups of them make chains longer than the distribution
+// slots, ht_chain_max must follow them down as they shrink
+static int collide_key(char *key, char prefix, unsigned int index, int blocks)
+{
+	int i;
+
+	key[0] = prefix;
+	for (i = 0; i < blocks; i++)
+		memcpy(key + 1 + 2 * i, index >> i & 1 ? "Ab" : "BA", 2);
+	return 1 + 2 * blocks;
+}
+
+static void check_long_chains(void)
+{
+	ko_test_node node = { .value = "v", .value_size = 1 };
+	struct ht ht;
+	char key[16];
+	unsigned int i;
+
+	check(ht_init(&ht, 2, "djb2", 0, NULL) == 0);
+	node.key = key;
+	for (i = 0; i < 64; i++)
+	{
+		node.key_size = collide_key(key, 'a', i, 6);
+		check(ht_add_item(&ht, &node, false, 0) == 0);
+		check(ht_chain_max(&ht) == i + 1);
+	}
+	for (i = 0; i < 40; i++)
+	{
+		node.key_size = collide_key(key, 'b', i, 6);
+		check(ht_add_item(&ht, &node, false, 0) == 0);
+	}
+	check(ht_chain_max(&ht) == 64);
+	for (i = 0; i < 64; i++)
+	{
+		check(ht_del_item(&ht, key, collide_key(key, 'a', i, 6)) == 0);
+		check(ht_chain_max(&ht) == (63 - i > 40 ? 63 - i : 40));
+	}
+	for (i = 0; i < 40; i++)
+	{
+		check(ht_del_item(&ht, key, collide_key(key, 'b', i, 6)) == 0);
+		check(ht_chain_max(&ht) == 39 - i);
+	}
+	ht_destroy(&ht);
+}
+
+// stress mode
+
+struct stress_config
+{
+	int writers;
+	int readers;
+	double duration;
+	unsigned long keys;
+	unsigned long max_bytes;
+	unsigned int ttl_ms;
+	bool open;
+};
+
+struct stress_thread
+{
+	pthread_t id;
+	int index;
+	uint64_t rng;
+	uint64_t ops;
+	// writers only: version of every owned key, 0 if it is absent
+	uint32_t *versions;
+};
+
+static struct stress_config stress_cfg = {
+	.writers = 4,
+	.readers = 4,
+	.duration = 5,
+	.keys = 1000,
+};
+
+static volatile int stress_stop;
+
+// items may disappear without being deleted
+static bool stress_lossy(void)
+{
+	return stress_cfg.max_bytes != 0 || stress_cfg.ttl_ms != 0;
+}
+
+static int stress_key(char *key, unsigned long index)
+{
+	return sprintf(key, "s%lu", index);
+}
+
+// the value is derived from the key and its version, so a reader can check
+// it without knowing which version it got
+static int stress_value(char *value, unsigned long index, uint32_t version)
+{
+	int size = value_sizes[(index + version) % ARRAY_SIZE(value_sizes)], i;
+
+	for (i = 0; i < size; i++)
+		value[i] = (char)(index * 31 + version * 7 + i);
+	if (size >= 4)
+		memcpy(value, &version, sizeof(version));
+	return size;
+}
+
+// keys are not null-terminated
+static unsigned long stress_key_index(const char *key, int key_size)
+{
+	unsigned long index;
+	char buf[32];
+
+	check(key_size < (int)sizeof(buf));
+	memcpy(buf, key, key_size);
+	buf[key_size] = 0;
+	check(sscanf(buf, "s%lu", &index) == 1);
+	check(index < stress_cfg.keys * stress_cfg.writers);
+	return index;
+}
+
+static void stress_check_value(const char *key, int key_size, const char *value,
+	int value_size)
+{
+	unsigned long index = stress_key_index(key, key_size);
+	char expected[FUZZ_MAX_VALUE];
+	uint32_t version;
+	int i;
+
+	if (value_size < 4)
+	{
+		// versions of short values are not known, check the size class
+		for (i = 0; i < (int)ARRAY_SIZE(value_sizes); i++)
+			if (value_sizes[i] == value_size)
+				return;
+		check(false);
+	}
+	memcpy(&version, value, sizeof(version));
+	check(stress_value(expected, index, version) == value_size);
+	check(memcmp(expected, value, value_size) == 0);
+}
+
+static void *stress_writer(void *arg)
+{
+	struct stress_thread *t = arg;
+	char key[32], value[FUZZ_MAX_VALUE];
+	ko_test_node node = { .key = key, .value = value };
+	unsigned long slot, index;
+	int res;
+
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED))
+	{
+		slot = rng_next(&t->rng) % stress_cfg.keys;
+		index = slot * stress_cfg.writers + t->index;
+		node.key_size = stress_key(key, index);
+		if (t->versions[slot] != 0 && rng_next(&t->rng) % 3 == 0)
+		{
+			res = ht_del_item(&table, key, node.key_size);
+			check(res == 0 || res == -EAGAIN || (res == -ENOENT && stress_lossy()));
+			if (res != -EAGAIN)
+				t->versions[slot] = 0;
+		}
+		else
+		{
+			uint32_t version = (uint32_t)rng_next(&t->rng) | 1;
+
+			node.value_size = stress_value(value, index, version);
+			res = ht_add_item(&table, &node, true, stress_cfg.ttl_ms != 0 ?
+				rng_next(&t->rng) % stress_cfg.ttl_ms + 1 : 0);
+			check(res == 0 || res == -EAGAIN);
+			if (res == 0)
+				t->versions[slot] = version;
+		}
+		t->ops++;
+	}
+	return NULL;
+}
+
+static void *stress_reader(void *arg)
+{
+	struct stress_thread *t = arg;
+	struct ht_item *item;
+	char key[32];
+	int key_size;
+
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED))
+	{
+		key_size = stress_key(key, rng_next(&t->rng) %
+			(stress_cfg.keys * stress_cfg.writers));
+		item = ht_get_item(&table, key, key_size);
+		if (item != NULL)
+		{
+			check(item->key_size == key_size && memcmp(item->key, key, key_size) == 0);
+			stress_check_value(item->key, item->key_size, item->value, item->value_size);
+			ht_item_put(item);
+		}
+		t->ops++;
+	}
+	return NULL;
+}
+
+// alternates scans with locked iterations and ordered reads, all must
+// return every key at most once
+static void *stress_scanner(void *arg)
+{
+	struct stress_thread *t = arg;
+	size_t size = SCAN_BUF_SIZE;
+	char *buf = malloc(size);
+	unsigned long total = stress_cfg.keys * stress_cfg.writers;
+	unsigned char *seen = malloc(total);
+	unsigned long pos, index;
+	struct ht_range range;
+	struct ht_item *item;
+	size_t used, offset;
+	char last[32];
+	int bkt, last_size;
+	long need;
+	bool done;
+
+	check(seen != NULL && buf != NULL);
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED))
+	{
+		// what the shrinker would do under memory pressure
+		if (stress_cfg.max_bytes != 0)
+			ht_shrink(&table, 16);
+		memset(seen, 0, total);
+		if (t->ops % 8 == 7)
+		{
+			if (!ht_lock_writes(&table))
+				continue;
+			for (item = ht_read_init(&table, &bkt, &item); item != NULL;
+				item = ht_read_next(&table, &bkt, &item))
+			{
+				stress_check_value(item->key, item->key_size, item->value, item->value_size);
+				index = stress_key_index(item->key, item->key_size);
+				check(seen[index]++ == 0);
+			}
+			ht_unlock_writes(&table);
+			t->ops++;
+			continue;
+		}
+		if (t->ops % 8 == 3)
+		{
+			memset(&range, 0, sizeof(range));
+			last_size = -1;
+			while (!range.done)
+			{
+				while ((need = ht_range_scan(&table, &range, buf, size, &used)) != 0)
+				{
+					check(need > 0);
+					buf = realloc(buf, need);
+					check(buf != NULL);
+					size = need;
+				}
+				for (offset = 0; offset < used; )
+				{
+					ko_test_record *rec = (ko_test_record *)(buf + offset);
+					char *key = buf + offset + sizeof(ko_test_record);
+
+					stress_check_value(key, rec->key_size, key + rec->key_size, rec->value_size);
+					check(last_size < 0 || key_cmp(last, last_size, key, rec->key_size) < 0);
+					memcpy(last, key, rec->key_size);
+					last_size = rec->key_size;
+					offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+				}
+			}
+			ht_range_free(&range);
+			t->ops++;
+			continue;
+		}
+		pos = 0;
+		done = false;
+		while (!done)
+		{
+			used = scan_next(&pos, &done, &buf, &size);
+			for (offset = 0; offset < used; )
+			{
+				ko_test_record *rec = (ko_test_record *)(buf + offset);
+				char *key = buf + offset + sizeof(ko_test_record);
+
+				stress_check_value(key, rec->key_size, key + rec->key_size, rec->value_size);
+				index = stress_key_index(key, rec->key_size);
+				check(seen[index]++ == 0);
+				offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+			}
+		}
+		t->ops++;
+	}
+	free(seen);
+	free(buf);
+	return NULL;
+}
+
+// after the threads are stopped the table must match the writers' view
+static void stress_verify(struct stress_thread *writers)
+{
+	char key[32], value[FUZZ_MAX_VALUE];
+	unsigned long slot, index;
+	struct ht_item *item;
+	int count = 0, i;
+
+	for (i = 0; i < stress_cfg.writers; i++)
+	{
+		for (slot = 0; slot < stress_cfg.keys; slot++)
+		{
+			uint32_t version = writers[i].versions[slot];
+			int key_size, value_size;
+
+			index = slot * stress_cfg.writers + i;
+			key_size = stress_key(key, index);
+			item = ht_get_item(&table, key, key_size);
+			// evicted items are missing, but never come back
+			check(item == NULL ? version == 0 || stress_lossy() : version != 0);
+			if (item == NULL)
+				continue;
+			value_size = stress_value(value, index, version);
+			check(item->value_size == value_size);
+			check(memcmp(item->value, value, value_size) == 0);
+			ht_item_put(item);
+			count++;
+		}
+	}
+	check(ht_item_count(&table) == count);
+}
+
+static int stress(void)
+{
+	int count = stress_cfg.writers + stress_cfg.readers + 1, i;
+	struct stress_thread *threads = calloc(count, sizeof(struct stress_thread));
+	uint64_t start = now_ns();
+	uint64_t ops[3] = { 0 };
+
+	check(threads != NULL);
+	check(ht_init(&table, 2, "siphash",
+		HT_ORDERED | (stress_cfg.open ? HT_OPEN : 0), NULL) == 0);
+	ht_max_bytes = stress_cfg.max_bytes;
+	for (i = 0; i < count; i++)
+	{
+		void *(*func)(void *) = stress_reader;
+
+		threads[i].index = i;
+		threads[i].rng = (start + i) * 0x9E3779B97F4A7C15ULL | 1;
+		if (i < stress_cfg.writers)
+		{
+			threads[i].versions = calloc(stress_cfg.keys, sizeof(uint32_t));
+			check(threads[i].versions != NULL);
+			func = stress_writer;
+		}
+		else if (i == count - 1)
+			func = stress_scanner;
+		check(pthread_create(&threads[i].id, NULL, func, &threads[i]) == 0);
+	}
+	usleep(stress_cfg.duration * 1000000);
+	__atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < count; i++)
+	{
+		pthread_join(threads[i].id, NULL);
+		ops[i < stress_cfg.writers ? 0 : i < count - 1 ? 1 : 2] += threads[i].ops;
+	}
+	// items with a TTL are counted until they are reclaimed
+	if (stress_cfg.ttl_ms != 0)
+	{
+		ktime_advance((uint64_t)stress_cfg.ttl_ms * 1000000);
+		ht_expire_all(&table);
+	}
+	stress_verify(threads);
+	printf("{\"writes\": %llu, \"reads\": %llu, \"iterations\": %llu, \"items\": %d, "
+		"\"buckets\": %u, \"memory_used\": %lu, \"evicted\": %lu, \"expired\": %lu}\n",
+		(unsigned long long)ops[0], (unsigned long long)ops[1],
+		(unsigned long long)ops[2], ht_item_count(&table), ht_bucket_count(&table),
+		ht_memory_used(&table), ht_stat_sum(&table, HT_STAT_EVICT), ht_stat_sum(&table, HT_STAT_EXPIRE));
+	ht_max_bytes = 0;
+	ht_destroy(&table);
+	for (i = 0; i < stress_cfg.writers; i++)
+		free(threads[i].versions);
+	free(threads);
+	return EXIT_SUCCESS;
+}
+
+static int replay(const char *path)
+{
+	static uint8_t data[1 << 20];
+	FILE *file = fopen(path, "rb");
+	size_t size;
+
+	if (file == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	size = fread(data, 1, sizeof(data), file);
+	fclose(file);
+	LLVMFuzzerTestOneInput(data, size);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [options] [input files]\n"
+		"  -i <count>     random inputs to run if no files are given, default 1000\n"
+		"  -l <size>      max random input size, default 4096\n"
+		"  -S <seed>      random seed, default current time\n"
+		"  -s             stress mode\n"
+		"  -w <count>     stress: writer threads, default %d\n"
+		"  -r <count>     stress: reader threads, default %d\n"
+		"  -d <seconds>   stress: duration, default %.0f\n"
+		"  -n <count>     stress: keys per writer, default %lu\n"
+		"  -b <bytes>     stress: memory budget, default unlimited\n"
+		"  -T <ms>        stress: max TTL of written items, default none\n"
+		"  -O             stress: open addressing lookups (HT_OPEN)\n",
+		name, stress_cfg.writers, stress_cfg.readers, stress_cfg.duration,
+		stress_cfg.keys);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long iterations = 1000, i;
+	size_t max_size = 4096, size, j;
+	uint64_t seed = now_ns();
+	bool stress_mode = false;
+	uint8_t *data;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:l:S:sw:r:d:n:b:T:Oh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			stress_mode = true;
+			break;
+		case 'w':
+			stress_cfg.writers = atoi(optarg);
+			break;
+		case 'r':
+			stress_cfg.readers = atoi(optarg);
+			break;
+		case 'd':
+			stress_cfg.duration = atof(optarg);
+			break;
+		case 'n':
+			stress_cfg.keys = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			stress_cfg.max_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			stress_cfg.ttl_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			stress_cfg.open = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (stress_mode)
+	{
+		if (stress_cfg.writers < 1 || stress_cfg.readers < 0 || stress_cfg.keys == 0)
+		{
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		return stress();
+	}
+	if (optind < argc)
+	{
+		for (; optind < argc; optind++)
+			if (replay(argv[optind]) != 0)
+				return EXIT_FAILURE;
+		return EXIT_SUCCESS;
+	}
+
+	check_long_chains();
+	printf("seed %llu\n", (unsigned long long)seed);
+	seed |= 1;
+	data = malloc(max_size + 1);
+	check(data != NULL);
+	for (i = 0; i < iterations; i++)
+	{
+		size = rng_next(&seed) % (max_size + 1);
+		for (j = 0; j < size; j++)
+			data[j] = rng_next(&seed) >> 56;
+		LLVMFuzzerTestOneInput(data, size);
+	}
+	free(data);
+	printf("%lu inputs passed\n", iterations);
+	return EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,688 @@
+// user space implementation of the kernel API declared in ht_user.h
+#include <sched.h>
+#include <sys/random.h>
+#include <time.h>
+#include "ht_user.h"
+
+static u64 ktime_offset;
+
+static u64 monotonic_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (u64)tp.tv_sec * 1000000000 + tp.tv_nsec;
+}
+
+u64 ktime_get_ns(void)
+{
+	return monotonic_ns() + __atomic_load_n(&ktime_offset, __ATOMIC_RELAXED);
+}
+
+void ktime_advance(u64 ns)
+{
+	__atomic_fetch_add(&ktime_offset, ns, __ATOMIC_RELAXED);
+}
+
+void get_random_bytes(void *buf, size_t size)
+{
+	ssize_t res;
+	size_t done = 0;
+
+	while (done < size)
+	{
+		res = getrandom((char *)buf + done, size - done, 0);
+		if (res > 0)
+			done += res;
+	}
+}
+
+int kstrtoll(const char *s, unsigned int base, s64 *res)
+{
+	bool negative = false;
+	u64 value = 0, limit;
+	const char *start;
+
+	if (*s == '+' || *s == '-')
+		negative = *s++ == '-';
+	limit = negative ? (u64)INT64_MAX + 1 : INT64_MAX;
+	for (start = s; *s >= '0' && *s < '0' + (int)base; s++)
+	{
+		if (value > (limit - (*s - '0')) / base)
+			return -ERANGE;
+		value = value * base + (*s - '0');
+	}
+	if (s == start)
+		return -EINVAL;
+	if (*s == '\n')
+		s++;
+	if (*s != 0)
+		return -EINVAL;
+	*res = negative ? (s64)(0 - value) : (s64)value;
+	return 0;
+}
+
+// SipHash-2-4 as in lib/siphash.c
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = rol64(v1, 13); v1 ^= v0; v0 = rol64(v0, 32); \
+		v2 += v3; v3 = rol64(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = rol64(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = rol64(v1, 17); v1 ^= v2; v2 = rol64(v2, 32); \
+	} while (0)
+
+static u64 rol64(u64 word, unsigned int shift)
+{
+	return (word << shift) | (word >> (64 - shift));
+}
+
+u64 siphash(const void *data, size_t len, const siphash_key_t *key)
+{
+	const u8 *p = data, *end = p + len - (len % sizeof(u64));
+	u64 v0 = 0x736f6d6570736575ULL;
+	u64 v1 = 0x646f72616e646f6dULL;
+	u64 v2 = 0x6c7967656e657261ULL;
+	u64 v3 = 0x7465646279746573ULL;
+	u64 b = ((u64)len) << 56;
+	u64 m;
+	int i;
+
+	v3 ^= key->key[1];
+	v2 ^= key->key[0];
+	v1 ^= key->key[1];
+	v0 ^= key->key[0];
+	for (; p != end; p += sizeof(u64))
+	{
+		memcpy(&m, p, sizeof(m));
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	for (i = len % sizeof(u64) - 1; i >= 0; i--)
+		b |= (u64)p[i] << (8 * i);
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+	unsigned int align, unsigned long flags, void (*ctor)(void *))
+{
+	struct kmem_cache *cache = malloc(sizeof(struct kmem_cache));
+
+	if (cache != NULL)
+		cache->size = size;
+	return cache;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	free(cache);
+}
+
+void *kcalloc(size_t n, size_t size, int flags)
+{
+	size_t total = (n * size + SMP_CACHE_BYTES - 1) & ~(size_t)(SMP_CACHE_BYTES - 1);
+	void *ptr = aligned_alloc(SMP_CACHE_BYTES, total);
+
+	if (ptr != NULL)
+		memset(ptr, 0, total);
+	return ptr;
+}
+
+// red-black tree as in Introduction to Algorithms, leaves are NULL and
+// count as black
+
+static bool rb_is_red(const struct rb_node *node)
+{
+	return node != NULL && node->rb_red;
+}
+
+// puts new in place of old in the parent of old or the root
+static void rb_set_child(struct rb_node *old, struct rb_node *new,
+	struct rb_node *parent, struct rb_root *root)
+{
+	if (parent == NULL)
+		root->rb_node = new;
+	else if (parent->rb_left == old)
+		parent->rb_left = new;
+	else
+		parent->rb_right = new;
+}
+
+static void rb_rotate_left(struct rb_node *x, struct rb_root *root)
+{
+	struct rb_node *y = x->rb_right;
+
+	x->rb_right = y->rb_left;
+	if (y->rb_left != NULL)
+		y->rb_left->rb_parent = x;
+	y->rb_parent = x->rb_parent;
+	rb_set_child(x, y, x->rb_parent, root);
+	y->rb_left = x;
+	x->rb_parent = y;
+}
+
+static void rb_rotate_right(struct rb_node *x, struct rb_root *root)
+{
+	struct rb_node *y = x->rb_left;
+
+	x->rb_left = y->rb_right;
+	if (y->rb_right != NULL)
+		y->rb_right->rb_parent = x;
+	y->rb_parent = x->rb_parent;
+	rb_set_child(x, y, x->rb_parent, root);
+	y->rb_right = x;
+	x->rb_parent = y;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	while (rb_is_red(parent = node->rb_parent))
+	{
+		gparent = parent->rb_parent;
+		if (parent == gparent->rb_left)
+		{
+			uncle = gparent->rb_right;
+			if (rb_is_red(uncle))
+			{
+				parent->rb_red = uncle->rb_red = false;
+				gparent->rb_red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_right)
+			{
+				rb_rotate_left(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = false;
+			gparent->rb_red = true;
+			rb_rotate_right(gparent, root);
+		}
+		else
+		{
+			uncle = gparent->rb_left;
+			if (rb_is_red(uncle))
+			{
+				parent->rb_red = uncle->rb_red = false;
+				gparent->rb_red = true;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->rb_left)
+			{
+				rb_rotate_right(parent, root);
+				node = parent;
+				parent = node->rb_parent;
+			}
+			parent->rb_red = false;
+			gparent->rb_red = true;
+			rb_rotate_left(gparent, root);
+		}
+	}
+	root->rb_node->rb_red = false;
+}
+
+// x took the place of a removed black node, x may be NULL so its parent
+// is passed along
+static void rb_erase_fixup(struct rb_node *x, struct rb_node *parent,
+	struct rb_root *root)
+{
+	struct rb_node *w;
+
+	while (x != root->rb_node && !rb_is_red(x))
+	{
+		if (x == parent->rb_left)
+		{
+			w = parent->rb_right;
+			if (rb_is_red(w))
+			{
+				w->rb_red = false;
+				parent->rb_red = true;
+				rb_rotate_left(parent, root);
+				w = parent->rb_right;
+			}
+			if (!rb_is_red(w->rb_left) && !rb_is_red(w->rb_right))
+			{
+				w->rb_red = true;
+				x = parent;
+				parent = x->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(w->rb_right))
+			{
+				w->rb_left->rb_red = false;
+				w->rb_red = true;
+				rb_rotate_right(w, root);
+				w = parent->rb_right;
+			}
+			w->rb_red = parent->rb_red;
+			parent->rb_red = false;
+			w->rb_right->rb_red = false;
+			rb_rotate_left(parent, root);
+		}
+		else
+		{
+			w = parent->rb_left;
+			if (rb_is_red(w))
+			{
+				w->rb_red = false;
+				parent->rb_red = true;
+				rb_rotate_right(parent, root);
+				w = parent->rb_left;
+			}
+			if (!rb_is_red(w->rb_left) && !rb_is_red(w->rb_right))
+			{
+				w->rb_red = true;
+				x = parent;
+				parent = x->rb_parent;
+				continue;
+			}
+			if (!rb_is_red(w->rb_left))
+			{
+				w->rb_right->rb_red = false;
+				w->rb_red = true;
+				rb_rotate_left(w, root);
+				w = parent->rb_left;
+			}
+			w->rb_red = parent->rb_red;
+			parent->rb_red = false;
+			w->rb_left->rb_red = false;
+			rb_rotate_right(parent, root);
+		}
+		x = root->rb_node;
+	}
+	if (x != NULL)
+		x->rb_red = false;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *y = node, *x, *parent;
+	bool red = node->rb_red;
+
+	if (node->rb_left == NULL || node->rb_right == NULL)
+	{
+		x = node->rb_left != NULL ? node->rb_left : node->rb_right;
+		parent = node->rb_parent;
+		if (x != NULL)
+			x->rb_parent = parent;
+		rb_set_child(node, x, parent, root);
+	}
+	else
+	{
+		// the successor y has no left child and takes the place of node
+		for (y = node->rb_right; y->rb_left != NULL; y = y->rb_left)
+			;
+		red = y->rb_red;
+		x = y->rb_right;
+		if (y->rb_parent == node)
+			parent = y;
+		else
+		{
+			parent = y->rb_parent;
+			if (x != NULL)
+				x->rb_parent = parent;
+			parent->rb_left = x;
+			y->rb_right = node->rb_right;
+			y->rb_right->rb_parent = y;
+		}
+		rb_set_child(node, y, node->rb_parent, root);
+		y->rb_parent = node->rb_parent;
+		y->rb_left = node->rb_left;
+		y->rb_left->rb_parent = y;
+		y->rb_red = node->rb_red;
+	}
+	if (!red)
+		rb_erase_fixup(x, parent, root);
+}
+
+void rb_replace_node(struct rb_node *victim, struct rb_node *new, struct rb_root *root)
+{
+	*new = *victim;
+	if (victim->rb_left != NULL)
+		victim->rb_left->rb_parent = new;
+	if (victim->rb_right != NULL)
+		victim->rb_right->rb_parent = new;
+	rb_set_child(victim, new, victim->rb_parent, root);
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	const struct rb_node *parent;
+
+	if (node->rb_right != NULL)
+	{
+		for (node = node->rb_right; node->rb_left != NULL; node = node->rb_left)
+			;
+		return (struct rb_node *)node;
+	}
+	while ((parent = node->rb_parent) != NULL && node == parent->rb_right)
+		node = parent;
+	return (struct rb_node *)parent;
+}
+
+// RCU. Every thread publishes the grace period counter it has seen when
+// it entered the outermost read section, or 0 outside of it.
+// synchronize_rcu starts a new period and waits until no thread is inside
+// a section started in an older one. Seq-cst fences on both sides make
+// sure a reader either is seen by synchronize_rcu or sees the updates
+// done before it. ThreadSanitizer does not understand the fences, a read
+// write lock is used instead in its builds
+
+struct rcu_reader
+{
+	u64 period;
+	int nesting;
+	struct rcu_reader *next;
+};
+
+static pthread_mutex_t rcu_readers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_reader *rcu_readers;
+static pthread_key_t rcu_reader_key;
+static pthread_once_t rcu_reader_once = PTHREAD_ONCE_INIT;
+static __thread struct rcu_reader *rcu_self;
+static u64 rcu_period = 1;
+#ifdef __SANITIZE_THREAD__
+static pthread_rwlock_t rcu_tsan_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
+
+static void rcu_reader_exit(void *arg)
+{
+	struct rcu_reader *reader = arg, **pos;
+
+	pthread_mutex_lock(&rcu_readers_lock);
+	for (pos = &rcu_readers; *pos != NULL; pos = &(*pos)->next)
+	{
+		if (*pos == reader)
+		{
+			*pos = reader->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rcu_readers_lock);
+	free(reader);
+}
+
+static void rcu_reader_key_init(void)
+{
+	pthread_key_create(&rcu_reader_key, rcu_reader_exit);
+}
+
+static struct rcu_reader *rcu_reader(void)
+{
+	if (rcu_self != NULL)
+		return rcu_self;
+	pthread_once(&rcu_reader_once, rcu_reader_key_init);
+	rcu_self = calloc(1, sizeof(struct rcu_reader));
+	if (rcu_self == NULL)
+		abort();
+	pthread_setspecific(rcu_reader_key, rcu_self);
+	pthread_mutex_lock(&rcu_readers_lock);
+	rcu_self->next = rcu_readers;
+	rcu_readers = rcu_self;
+	pthread_mutex_unlock(&rcu_readers_lock);
+	return rcu_self;
+}
+
+void rcu_read_lock(void)
+{
+	struct rcu_reader *reader = rcu_reader();
+
+	if (reader->nesting++ == 0)
+	{
+#ifdef __SANITIZE_THREAD__
+		pthread_rwlock_rdlock(&rcu_tsan_lock);
+#endif
+		__atomic_store_n(&reader->period,
+			__atomic_load_n(&rcu_period, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void rcu_read_unlock(void)
+{
+	struct rcu_reader *reader = rcu_self;
+
+	if (--reader->nesting == 0)
+	{
+		__atomic_store_n(&reader->period, 0, __ATOMIC_RELEASE);
+#ifdef __SANITIZE_THREAD__
+		pthread_rwlock_unlock(&rcu_tsan_lock);
+#endif
+	}
+}
+
+void synchronize_rcu(void)
+{
+	struct rcu_reader *reader;
+	u64 period;
+
+#ifdef __SANITIZE_THREAD__
+	pthread_rwlock_wrlock(&rcu_tsan_lock);
+	pthread_rwlock_unlock(&rcu_tsan_lock);
+	return;
+#endif
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&rcu_readers_lock);
+	period = __atomic_add_fetch(&rcu_period, 1, __ATOMIC_SEQ_CST);
+	for (reader = rcu_readers; reader != NULL; reader = reader->next)
+	{
+		u64 seen;
+
+		while ((seen = __atomic_load_n(&reader->period, __ATOMIC_ACQUIRE)) != 0 &&
+			seen < period)
+			sched_yield();
+	}
+	pthread_mutex_unlock(&rcu_readers_lock);
+}
+
+// callbacks are run in batches, each batch after its own grace period.
+// A batch is started by call_rcu outside of a read section or rcu_barrier
+
+#define RCU_BATCH 1024
+
+static pthread_mutex_t rcu_callbacks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_head *rcu_callbacks;
+static unsigned int rcu_callback_count;
+
+static void rcu_run_callbacks(void)
+{
+	struct rcu_head *head, *next;
+
+	pthread_mutex_lock(&rcu_callbacks_lock);
+	head = rcu_callbacks;
+	rcu_callbacks = NULL;
+	rcu_callback_count = 0;
+	pthread_mutex_unlock(&rcu_callbacks_lock);
+	if (head == NULL)
+		return;
+	synchronize_rcu();
+	for (; head != NULL; head = next)
+	{
+		next = head->next;
+		head->func(head);
+	}
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	bool run;
+
+	head->func = func;
+	pthread_mutex_lock(&rcu_callbacks_lock);
+	head->next = rcu_callbacks;
+	rcu_callbacks = head;
+	run = ++rcu_callback_count >= RCU_BATCH;
+	pthread_mutex_unlock(&rcu_callbacks_lock);
+	if (run && rcu_reader()->nesting == 0)
+		rcu_run_callbacks();
+}
+
+void rcu_barrier(void)
+{
+	rcu_run_callbacks();
+}
+
+// workqueue
+
+struct workqueue_struct *system_unbound_wq;
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct work_struct *work_list;
+static pthread_t work_thread;
+static bool work_thread_started;
+
+// removes the first work that is due from the list, otherwise returns
+// NULL and the time the next one is due at, 0 if the list is empty
+static struct work_struct *work_next(u64 *due)
+{
+	struct work_struct **pos, *work;
+	u64 now = monotonic_ns();
+
+	*due = 0;
+	for (pos = &work_list; *pos != NULL; pos = &(*pos)->next)
+	{
+		work = *pos;
+		if (work->due <= now)
+		{
+			*pos = work->next;
+			return work;
+		}
+		if (*due == 0 || work->due < *due)
+			*due = work->due;
+	}
+	return NULL;
+}
+
+// the condition variable uses the realtime clock
+static void work_wait_until(u64 due)
+{
+	struct timespec tp;
+	u64 deadline;
+
+	clock_gettime(CLOCK_REALTIME, &tp);
+	deadline = (u64)tp.tv_sec * 1000000000 + tp.tv_nsec + (due - monotonic_ns());
+	tp.tv_sec = deadline / 1000000000;
+	tp.tv_nsec = deadline % 1000000000;
+	pthread_cond_timedwait(&work_cond, &work_lock, &tp);
+}
+
+static void *work_thread_main(void *arg)
+{
+	struct work_struct *work;
+	u64 due;
+
+	pthread_mutex_lock(&work_lock);
+	for (;;)
+	{
+		while ((work = work_next(&due)) == NULL)
+		{
+			if (due == 0)
+				pthread_cond_wait(&work_cond, &work_lock);
+			else
+				work_wait_until(due);
+		}
+		work->pending = false;
+		work->running = true;
+		pthread_mutex_unlock(&work_lock);
+		work->func(work);
+		pthread_mutex_lock(&work_lock);
+		work->running = false;
+		pthread_cond_broadcast(&work_cond);
+	}
+	return NULL;
+}
+
+static bool work_queue(struct work_struct *work, u64 due)
+{
+	struct work_struct **pos;
+	bool res = false;
+
+	pthread_mutex_lock(&work_lock);
+	if (!work_thread_started)
+	{
+		if (pthread_create(&work_thread, NULL, work_thread_main, NULL) != 0)
+			abort();
+		pthread_detach(work_thread);
+		work_thread_started = true;
+	}
+	if (!work->pending && !work->canceling)
+	{
+		work->pending = true;
+		work->due = due;
+		work->next = NULL;
+		for (pos = &work_list; *pos != NULL; pos = &(*pos)->next)
+			;
+		*pos = work;
+		pthread_cond_broadcast(&work_cond);
+		res = true;
+	}
+	pthread_mutex_unlock(&work_lock);
+	return res;
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return work_queue(work, 0);
+}
+
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+	unsigned long delay)
+{
+	return work_queue(&dwork->work, delay ? monotonic_ns() + delay * 1000000 : 0);
+}
+
+static bool work_wait_idle(struct work_struct *work, bool cancel)
+{
+	struct work_struct **pos;
+	bool res = work->pending || work->running;
+
+	if (cancel && work->pending)
+	{
+		for (pos = &work_list; *pos != work; pos = &(*pos)->next)
+			;
+		*pos = work->next;
+		work->pending = false;
+	}
+	// a running work may not queue itself again while it is canceled
+	work->canceling = cancel;
+	while (work->pending || work->running)
+		pthread_cond_wait(&work_cond, &work_lock);
+	work->canceling = false;
+	return res;
+}
+
+bool flush_work(struct work_struct *work)
+{
+	bool res;
+
+	pthread_mutex_lock(&work_lock);
+	res = work_wait_idle(work, false);
+	pthread_mutex_unlock(&work_lock);
+	return res;
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	bool res;
+
+	pthread_mutex_lock(&work_lock);
+	res = work_wait_idle(work, true);
+	pthread_mutex_unlock(&work_lock);
+	return res;
+}
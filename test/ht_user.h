@@ -0,0 +1,426 @@
+#ifndef HT_USER_H
+#define HT_USER_H
+
+// The kernel API used by ../ht.c, implemented on top of libc and pthreads
+// so the hash table core runs in user space. Only what ht.c needs is here.
+// RCU readers only mark themselves in a per-thread counter, so lookups cost
+// about as much as in the kernel; synchronize_rcu waits for every reader
+// that started before it, see ht_user.c
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define GFP_KERNEL 0
+#define SLAB_HWCACHE_ALIGN 0
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+#define __rcu
+#define __percpu
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((__typeof__(x))(a) - 1))
+#define PAGE_SIZE 4096UL
+#define PAGE_ALIGN(x) ALIGN(x, PAGE_SIZE)
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a < _b ? _a : _b; })
+#define max(a, b) ({ __typeof__(a) _a = (a); __typeof__(b) _b = (b); _a > _b ? _a : _b; })
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+#define check_add_overflow(a, b, d) __builtin_add_overflow(a, b, d)
+
+#define pr_fmt(fmt) fmt
+#define pr_err(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__)
+#define pr_debug(fmt, ...) do { if (0) fprintf(stderr, pr_fmt(fmt), ##__VA_ARGS__); } while (0)
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, (v), __ATOMIC_RELEASE)
+
+static inline void cond_resched(void)
+{
+}
+
+static inline int fls(unsigned int x)
+{
+	return x ? 32 - __builtin_clz(x) : 0;
+}
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+#define ilog2(n) (fls64(n) - 1)
+
+// index of the lowest set bit, x must not be zero
+static inline unsigned long __ffs(unsigned long x)
+{
+	return __builtin_ctzl(x);
+}
+
+// bitmaps, set_bit and clear_bit are atomic as in the kernel
+
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void set_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG),
+		__ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[nr / BITS_PER_LONG], ~(1UL << (nr % BITS_PER_LONG)),
+		__ATOMIC_RELAXED);
+}
+
+static inline bool test_bit(unsigned long nr, const unsigned long *addr)
+{
+	return (__atomic_load_n(&addr[nr / BITS_PER_LONG], __ATOMIC_RELAXED) >>
+		(nr % BITS_PER_LONG)) & 1;
+}
+
+// index of the first set bit from offset, size if there is none
+static inline unsigned long find_next_bit(const unsigned long *addr,
+	unsigned long size, unsigned long offset)
+{
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	word = __atomic_load_n(&addr[offset / BITS_PER_LONG], __ATOMIC_RELAXED) &
+		(~0UL << (offset % BITS_PER_LONG));
+	offset -= offset % BITS_PER_LONG;
+	while (word == 0)
+	{
+		offset += BITS_PER_LONG;
+		if (offset >= size)
+			return size;
+		word = __atomic_load_n(&addr[offset / BITS_PER_LONG], __ATOMIC_RELAXED);
+	}
+	return min(offset + __builtin_ctzl(word), size);
+}
+
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u64 hash_64(u64 val, unsigned int bits)
+{
+	return val * GOLDEN_RATIO_64 >> (64 - bits);
+}
+
+#define hash_long(val, bits) hash_64(val, bits)
+
+#define NSEC_PER_MSEC 1000000ULL
+
+u64 ktime_get_ns(void);
+// moves ktime_get_ns() forward, tests use it to expire items
+void ktime_advance(u64 ns);
+void get_random_bytes(void *buf, size_t size);
+// as in lib/kstrtox.c: optional sign, digits and one trailing newline
+int kstrtoll(const char *s, unsigned int base, s64 *res);
+
+typedef struct
+{
+	u64 key[2];
+} siphash_key_t;
+
+u64 siphash(const void *data, size_t len, const siphash_key_t *key);
+
+// atomics and reference counts
+
+typedef struct
+{
+	int counter;
+} atomic_t;
+
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_inc(v) ((void)__atomic_fetch_add(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_dec(v) ((void)__atomic_fetch_sub(&(v)->counter, 1, __ATOMIC_RELAXED))
+#define atomic_add(i, v) ((void)__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_read_acquire(v) __atomic_load_n(&(v)->counter, __ATOMIC_ACQUIRE)
+#define atomic_set_release(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELEASE)
+
+typedef struct
+{
+	long counter;
+} atomic_long_t;
+
+#define ATOMIC_LONG_INIT(i) { (i) }
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_add(i, v) ((void)__atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED))
+#define atomic_long_sub(i, v) ((void)__atomic_fetch_sub(&(v)->counter, (i), __ATOMIC_RELAXED))
+
+static inline int atomic_cmpxchg(atomic_t *v, int old, int new)
+{
+	__atomic_compare_exchange_n(&v->counter, &old, new, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return old;
+}
+
+typedef struct
+{
+	int refs;
+} refcount_t;
+
+static inline void refcount_set(refcount_t *r, int n)
+{
+	__atomic_store_n(&r->refs, n, __ATOMIC_RELAXED);
+}
+
+static inline bool refcount_inc_not_zero(refcount_t *r)
+{
+	int old = __atomic_load_n(&r->refs, __ATOMIC_RELAXED);
+
+	do
+	{
+		if (old == 0)
+			return false;
+	} while (!__atomic_compare_exchange_n(&r->refs, &old, old + 1, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return true;
+}
+
+static inline void refcount_inc(refcount_t *r)
+{
+	__atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool refcount_dec_and_test(refcount_t *r)
+{
+	return __atomic_fetch_sub(&r->refs, 1, __ATOMIC_ACQ_REL) == 1;
+}
+
+// per-CPU data is a single shared copy
+
+#define DEFINE_PER_CPU(type, name) type name
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define this_cpu_inc(x) ((void)__atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED))
+#define per_cpu_ptr(ptr, cpu) (ptr)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+// memory
+
+struct kmem_cache
+{
+	size_t size;
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+	unsigned int align, unsigned long flags, void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cache);
+
+static inline void *kmem_cache_alloc(struct kmem_cache *cache, int flags)
+{
+	return malloc(cache->size);
+}
+
+static inline void kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	free(ptr);
+}
+
+#define kmalloc(size, flags) malloc(size)
+#define kmalloc_array(n, size, flags) malloc((n) * (size))
+#define kvmalloc(size, flags) malloc(size)
+#define kvzalloc(size, flags) calloc(1, size)
+#define kfree(ptr) free(ptr)
+#define kvfree(ptr) free(ptr)
+#define vmalloc_user(size) calloc(1, size)
+#define vfree(ptr) free(ptr)
+
+// elements may be cache line aligned
+void *kcalloc(size_t n, size_t size, int flags);
+
+// locks
+
+struct mutex
+{
+	pthread_mutex_t lock;
+};
+
+#define DEFINE_MUTEX(name) struct mutex name = { PTHREAD_MUTEX_INITIALIZER }
+#define mutex_init(m) pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_destroy(m) pthread_mutex_destroy(&(m)->lock)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+#define mutex_trylock(m) (pthread_mutex_trylock(&(m)->lock) == 0)
+#define lockdep_is_held(m) 1
+
+typedef struct
+{
+	pthread_mutex_t lock;
+} spinlock_t;
+
+#define spin_lock_init(l) pthread_mutex_init(&(l)->lock, NULL)
+#define spin_lock(l) pthread_mutex_lock(&(l)->lock)
+#define spin_unlock(l) pthread_mutex_unlock(&(l)->lock)
+
+// RCU
+
+struct rcu_head
+{
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+
+#define rcu_dereference_raw(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference(p) rcu_dereference_raw(p)
+#define rcu_dereference_check(p, c) rcu_dereference_raw(p)
+// writers may read a pointer the resize worker is changing
+#define rcu_dereference_protected(p, c) READ_ONCE(p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) WRITE_ONCE(p, v)
+
+// hlist with the RCU variants of the kernel, readers may run concurrently
+// with a single writer of the list
+
+struct hlist_node
+{
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head
+{
+	struct hlist_node *first;
+};
+
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+#define hlist_empty(h) (READ_ONCE((h)->first) == NULL)
+#define hlist_first_rcu(h) ((h)->first)
+#define hlist_next_rcu(n) ((n)->next)
+
+static inline void hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h)
+{
+	struct hlist_node *first = h->first;
+
+	n->next = first;
+	n->pprev = &h->first;
+	rcu_assign_pointer(h->first, n);
+	if (first != NULL)
+		first->pprev = &n->next;
+}
+
+// n->next is kept, readers standing on n still reach the rest of the list.
+// The kernel relies on address dependencies here, a release store makes
+// the same ordering visible to ThreadSanitizer
+static inline void hlist_del_rcu(struct hlist_node *n)
+{
+	struct hlist_node *next = n->next;
+
+	rcu_assign_pointer(*n->pprev, next);
+	if (next != NULL)
+		next->pprev = n->pprev;
+	n->pprev = NULL;
+}
+
+static inline void hlist_replace_rcu(struct hlist_node *old, struct hlist_node *new)
+{
+	struct hlist_node *next = old->next;
+
+	new->next = next;
+	new->pprev = old->pprev;
+	rcu_assign_pointer(*new->pprev, new);
+	if (next != NULL)
+		next->pprev = &new->next;
+	old->pprev = NULL;
+}
+
+// red-black tree, the kernel interface over a plain implementation with
+// NULL leaves, see ht_user.c. Not safe for concurrent readers
+
+struct rb_node
+{
+	struct rb_node *rb_parent;
+	struct rb_node *rb_right;
+	struct rb_node *rb_left;
+	bool rb_red;
+};
+
+struct rb_root
+{
+	struct rb_node *rb_node;
+};
+
+#define RB_ROOT (struct rb_root){ NULL }
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+	struct rb_node **link)
+{
+	node->rb_parent = parent;
+	node->rb_left = node->rb_right = NULL;
+	node->rb_red = true;
+	*link = node;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+void rb_erase(struct rb_node *node, struct rb_root *root);
+void rb_replace_node(struct rb_node *victim, struct rb_node *new, struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+
+// work items run one at a time on a single background thread. Delayed
+// work waits on the same thread, jiffies are milliseconds here
+
+struct work_struct
+{
+	void (*func)(struct work_struct *work);
+	struct work_struct *next;
+	// monotonic time in ns the work may run at, 0 to run at once
+	u64 due;
+	bool pending;
+	bool running;
+	// cancel_work_sync is waiting, the work may not be queued again
+	bool canceling;
+};
+
+struct delayed_work
+{
+	struct work_struct work;
+};
+
+struct workqueue_struct;
+extern struct workqueue_struct *system_unbound_wq;
+
+#define DECLARE_WORK(name, f) struct work_struct name = { .func = (f) }
+#define DECLARE_DELAYED_WORK(name, f) struct delayed_work name = { .work = { .func = (f) } }
+#define INIT_WORK(w, f) (*(w) = (struct work_struct){ .func = (f) })
+#define INIT_DELAYED_WORK(dw, f) INIT_WORK(&(dw)->work, f)
+#define to_delayed_work(w) container_of(w, struct delayed_work, work)
+#define msecs_to_jiffies(ms) ((unsigned long)(ms))
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
+	unsigned long delay);
+bool flush_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
+#define cancel_delayed_work_sync(dwork) cancel_work_sync(&(dwork)->work)
+
+#endif // HT_USER_H
@@ -1,8 +1,10 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -46,6 +48,7 @@ static void alloc_random_string(char **out_str, int *out_size)
 
 static int cmd_add(int fd, int argc, char **argv)
 {
+	ko_test_ttl_node ttl_node = { .ttl_ms = 0 };
 	ko_test_node node;
 	int ret;
 
@@ -56,6 +59,9 @@ static int cmd_add(int fd, int argc, char **argv)
 		alloc_random_string(&node.value, &node.value_size);
 		printf("using random key-value pair: %s %s\n", node.key, node.value);
 		break;
+	case 3:
+		ttl_node.ttl_ms = strtoul(argv[2], NULL, 0);
+		/* fall through */
 	case 2:
 		node.key = argv[0];
 		node.key_size = strlen(argv[0]);
@@ -63,11 +69,17 @@ static int cmd_add(int fd, int argc, char **argv)
 		node.value_size = strlen(argv[1]);
 		break;
 	default:
-		printf("usage: add [<key> <value>]\n");
+		printf("usage: add [<key> <value> [<ttl ms>]]\n");
 		return -1;
 	}
 
-	ret = ioctl(fd, KO_TEST_IOCTL_ADD, &node);
+	if (ttl_node.ttl_ms != 0)
+	{
+		ttl_node.node = node;
+		ret = ioctl(fd, KO_TEST_IOCTL_ADD_TTL, &ttl_node);
+	}
+	else
+		ret = ioctl(fd, KO_TEST_IOCTL_ADD, &node);
 	if (argc == 0)
 	{
 	    free(node.key);
@@ -83,7 +95,8 @@ static int cmd_add(int fd, int argc, char **argv)
 
 static int cmd_get(int fd, int argc, char **argv)
 {
-	ko_test_node node;
+	ko_test_update update;
+	ko_test_node *node = &update.node;
 	int ret;
 
 	if (argc != 1)
@@ -91,29 +104,147 @@ static int cmd_get(int fd, int argc, char **argv)
 		printf("usage: get <key>\n");
 		return -1;
 	}
-	memset(&node, 0, sizeof(node));
-	node.key = argv[0];
-	node.key_size = strlen(argv[0]);
+	memset(&update, 0, sizeof(update));
+	node->key = argv[0];
+	node->key_size = strlen(argv[0]);
 
-	ret = ioctl(fd, KO_TEST_IOCTL_GET, &node);
+	ret = ioctl(fd, KO_TEST_IOCTL_GETV, &update);
 	if (ret == -1)
 	{
 	    if (errno != ENOSPC)
 	    {
-		perror("ioctl - KO_TEST_IOCTL_GET");
+		perror("ioctl - KO_TEST_IOCTL_GETV");
 		return -1;
 	    }
-	    node.value = realloc_string(NULL, node.value_size);
-	    ret = ioctl(fd, KO_TEST_IOCTL_GET, &node);
+	    node->value = realloc_string(NULL, node->value_size);
+	    ret = ioctl(fd, KO_TEST_IOCTL_GETV, &update);
 	    if (ret == -1)
 	    {
-		perror("ioctl - KO_TEST_IOCTL_GET");
-		free(node.value);
+		perror("ioctl - KO_TEST_IOCTL_GETV");
+		free(node->value);
 		return -1;
 	    }
 	}
-	printf("key-value pair: %s %s\n", node.key, node.value);
-	free(node.value);
+	printf("key-value pair: %s %.*s, version %llu\n", node->key,
+		node->value_size, node->value ? node->value : "", update.version);
+	free(node->value);
+	return 0;
+}
+
+// the value is written to stdout straight from the mapping
+static int cmd_map(int fd, int argc, char **argv)
+{
+	ko_test_map map;
+
+	if (argc != 1)
+	{
+		printf("usage: map <key>\n");
+		return -1;
+	}
+	memset(&map, 0, sizeof(map));
+	map.key = argv[0];
+	map.key_size = strlen(argv[0]);
+	if (ioctl(fd, KO_TEST_IOCTL_MAP_VALUE, &map) == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_MAP_VALUE");
+		return -1;
+	}
+	printf("value of %s: %d bytes, version %llu\n", map.key, map.value_size,
+		map.version);
+	fflush(stdout);
+	if (write(STDOUT_FILENO, map.value, map.value_size) != map.value_size)
+		perror("write");
+	printf("\n");
+	munmap((void *)map.value, map.value_size);
+	return 0;
+}
+
+// cas <key> <value> <version> [<expected value>], version 0 is not compared
+static int cmd_cas(int fd, int argc, char **argv)
+{
+	ko_test_update update;
+	int ret;
+
+	if (argc != 3 && argc != 4)
+	{
+		printf("usage: cas <key> <value> <version> [<expected value>]\n");
+		return -1;
+	}
+	memset(&update, 0, sizeof(update));
+	update.node.key = argv[0];
+	update.node.key_size = strlen(argv[0]);
+	update.node.value = argv[1];
+	update.node.value_size = strlen(argv[1]);
+	update.version = strtoull(argv[2], NULL, 0);
+	if (argc == 4)
+	{
+		update.expected = argv[3];
+		update.expected_size = strlen(argv[3]);
+	}
+
+	ret = ioctl(fd, KO_TEST_IOCTL_CAS, &update);
+	if (ret == -1 && errno == ECANCELED)
+	{
+		printf("key %s changed, current version %llu\n", argv[0], update.version);
+		return -1;
+	}
+	if (ret == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_CAS");
+		return -1;
+	}
+	printf("key %s set, version %llu\n", argv[0], update.version);
+	return 0;
+}
+
+static int cmd_incr(int fd, int argc, char **argv)
+{
+	ko_test_update update;
+	int ret;
+
+	if (argc != 1 && argc != 2)
+	{
+		printf("usage: incr <key> [<delta>]\n");
+		return -1;
+	}
+	memset(&update, 0, sizeof(update));
+	update.node.key = argv[0];
+	update.node.key_size = strlen(argv[0]);
+	update.number = argc == 2 ? strtoll(argv[1], NULL, 0) : 1;
+
+	ret = ioctl(fd, KO_TEST_IOCTL_INCR, &update);
+	if (ret == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_INCR");
+		return -1;
+	}
+	printf("key %s = %lld, version %llu\n", argv[0], update.number, update.version);
+	return 0;
+}
+
+static int cmd_append(int fd, int argc, char **argv)
+{
+	ko_test_update update;
+	int ret;
+
+	if (argc != 2)
+	{
+		printf("usage: append <key> <value>\n");
+		return -1;
+	}
+	memset(&update, 0, sizeof(update));
+	update.node.key = argv[0];
+	update.node.key_size = strlen(argv[0]);
+	update.node.value = argv[1];
+	update.node.value_size = strlen(argv[1]);
+
+	ret = ioctl(fd, KO_TEST_IOCTL_APPEND, &update);
+	if (ret == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_APPEND");
+		return -1;
+	}
+	printf("key %s appended, version %llu\n", argv[0], update.version);
 	return 0;
 }
 
@@ -141,46 +272,260 @@ static int cmd_del(int fd, int argc, char **argv)
 	return 0;
 }
 
+static int cmd_mget(int fd, int argc, char **argv)
+{
+	ko_test_batch batch;
+	ko_test_node *nodes;
+	int *results;
+	int i, ret;
+
+	if (argc < 1 || argc > KO_TEST_MAX_BATCH)
+	{
+		printf("usage: mget <key> [<key> ...]\n");
+		return -1;
+	}
+	nodes = calloc(argc, sizeof(ko_test_node));
+	results = calloc(argc, sizeof(int));
+	for (i = 0; i < argc; i++)
+	{
+		nodes[i].key = argv[i];
+		nodes[i].key_size = strlen(argv[i]);
+		nodes[i].value_size = MAX_STRING_SIZE;
+		nodes[i].value = realloc_string(NULL, nodes[i].value_size);
+	}
+	batch.nodes = nodes;
+	batch.results = results;
+	batch.count = argc;
+
+	ret = ioctl(fd, KO_TEST_IOCTL_MGET, &batch);
+	if (ret == -1)
+		perror("ioctl - KO_TEST_IOCTL_MGET");
+	else
+	{
+		for (i = 0; i < argc; i++)
+		{
+			if (results[i] == 0)
+				printf("key-value pair: %s %.*s\n", nodes[i].key,
+					nodes[i].value_size, nodes[i].value);
+			else
+				printf("key %s: %s\n", nodes[i].key, strerror(-results[i]));
+		}
+	}
+	for (i = 0; i < argc; i++)
+		free(nodes[i].value);
+	free(nodes);
+	free(results);
+	return ret == -1 ? -1 : 0;
+}
+
+#define READ_BULK_SIZE (64 * 1024)
+
+// prints the records of a started read and ends it
+static int print_records(int fd)
+{
+	ko_test_bulk bulk;
+	ko_test_record *rec;
+	unsigned int size = READ_BULK_SIZE, offset, i;
+	int ret, index = 0;
+	char *buf;
+
+	buf = malloc(size);
+
+	for (;;)
+	{
+		bulk.buf = buf;
+		bulk.size = size;
+		ret = ioctl(fd, KO_TEST_IOCTL_READ_BULK, &bulk);
+		if (ret < 0)
+		{
+			if (errno == ENOENT)
+				break;
+			if (errno == ENOSPC)
+			{
+				// single record is larger than the buffer
+				size = bulk.size;
+				buf = realloc(buf, size);
+				continue;
+			}
+			perror("ioctl - KO_TEST_IOCTL_READ_BULK");
+			break;
+		}
+		for (i = 0, offset = 0; i < bulk.count; i++)
+		{
+			rec = (ko_test_record *)(buf + offset);
+			printf("#%d: %.*s - %.*s\n", index, rec->key_size, (char *)(rec + 1),
+				rec->value_size, (char *)(rec + 1) + rec->key_size);
+			offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+			index++;
+		}
+	}
+	free(buf);
+	ret = ioctl(fd, KO_TEST_IOCTL_READ_END);
+	if (ret < 0)
+	{
+		perror("ioctl - KO_TEST_IOCTL_READ_END");
+		return -1;
+	}
+	return 0;
+}
+
 static int cmd_read(int fd, int argc, char **argv)
 {
-	ko_test_node node;
 	int ret;
 
-    	ret = ioctl(fd, KO_TEST_IOCTL_READ_BEGIN);
+	if (argc > 1 || (argc == 1 && strcmp(argv[0], "locked") != 0))
+	{
+		printf("usage: read [locked]\n");
+		return -1;
+	}
+	ret = ioctl(fd, argc == 1 ? KO_TEST_IOCTL_READ_BEGIN_LOCKED : KO_TEST_IOCTL_READ_BEGIN);
 	if (ret < 0)
 	{
 		perror("ioctl - KO_TEST_IOCTL_READ_BEGIN");
 		return -1;
 	}
+	return print_records(fd);
+}
+
+// keys in order: range [<start> [<end>]] or prefix <prefix>
+static int cmd_range(int fd, int argc, char **argv, bool prefix)
+{
+	ko_test_range range = { 0 };
+	int ret;
+
+	if (prefix ? argc != 1 : argc > 2)
+	{
+		printf(prefix ? "usage: prefix <prefix>\n" : "usage: range [<start> [<end>]]\n");
+		return -1;
+	}
+	if (argc > 0)
+	{
+		range.start = argv[0];
+		range.start_size = strlen(argv[0]);
+	}
+	if (argc > 1)
+	{
+		range.end = argv[1];
+		range.end_size = strlen(argv[1]);
+	}
+	if (prefix)
+		range.flags = KO_TEST_RANGE_PREFIX;
+	ret = ioctl(fd, KO_TEST_IOCTL_READ_BEGIN_RANGE, &range);
+	if (ret < 0)
+	{
+		// the module is loaded without ordered_index=1
+		perror("ioctl - KO_TEST_IOCTL_READ_BEGIN_RANGE");
+		return -1;
+	}
+	return print_records(fd);
+}
+
+// the image is what KO_TEST_IOCTL_READ_BULK returns, written as is
+static int cmd_dump(int fd, int argc, char **argv)
+{
+	ko_test_bulk bulk;
+	unsigned int size = READ_BULK_SIZE, count = 0;
+	int ret, res = 0;
+	FILE *file;
+	char *buf;
+
+	if (argc != 1)
+	{
+		printf("usage: dump <file>\n");
+		return -1;
+	}
+	file = fopen(argv[0], "wb");
+	if (file == NULL)
+	{
+		perror(argv[0]);
+		return -1;
+	}
+	ret = ioctl(fd, KO_TEST_IOCTL_READ_BEGIN);
+	if (ret < 0)
+	{
+		perror("ioctl - KO_TEST_IOCTL_READ_BEGIN");
+		fclose(file);
+		return -1;
+	}
+	buf = malloc(size);
 
-	int index = 0;
 	for (;;)
 	{
-		memset(&node, 0, sizeof(node));
-		ret = ioctl(fd, KO_TEST_IOCTL_READ_NEXT, &node);
+		bulk.buf = buf;
+		bulk.size = size;
+		ret = ioctl(fd, KO_TEST_IOCTL_READ_BULK, &bulk);
 		if (ret < 0)
 		{
-		    if (errno == ENOENT)
+			if (errno == ENOENT)
+				break;
+			if (errno == ENOSPC)
+			{
+				size = bulk.size;
+				buf = realloc(buf, size);
+				continue;
+			}
+			perror("ioctl - KO_TEST_IOCTL_READ_BULK");
+			res = -1;
 			break;
-		    if (errno == ENOSPC)
-		    {
-			node.key = realloc_string(node.key, node.key_size);
-			node.value = realloc_string(node.value, node.value_size);
-			ret = ioctl(fd, KO_TEST_IOCTL_READ_NEXT, &node);
-		    }
-		    if (ret < 0)
-		    {
-			perror("ioctl - KO_TEST_IOCTL_READ_NEXT");
+		}
+		if (fwrite(buf, 1, bulk.used, file) != bulk.used)
+		{
+			perror(argv[0]);
+			res = -1;
 			break;
-		    }
-		    printf("#%d: %s - %s\n", index, node.key, node.value);
-		    index++;
 		}
-	}	
-	ret = ioctl(fd, KO_TEST_IOCTL_READ_END);
-	if (ret < 0)
+		count += bulk.count;
+	}
+	free(buf);
+	ioctl(fd, KO_TEST_IOCTL_READ_END);
+	if (fclose(file) != 0)
+		res = -1;
+	if (res == 0)
+		printf("%u records dumped\n", count);
+	return res;
+}
+
+static int cmd_load(int fd, int argc, char **argv)
+{
+	ko_test_load load = { .flags = 0 };
+	ko_test_record *rec;
+	unsigned long long offset;
+	FILE *file;
+	long size;
+	int ret;
+
+	if (argc < 1 || argc > 2 || (argc == 2 && strcmp(argv[1], "trusted") != 0))
 	{
-		perror("ioctl - KO_TEST_IOCTL_READ_END");
+		printf("usage: load <file> [trusted]\n");
+		return -1;
+	}
+	file = fopen(argv[0], "rb");
+	if (file == NULL || fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) < 0)
+	{
+		perror(argv[0]);
+		if (file != NULL)
+			fclose(file);
+		return -1;
+	}
+	rewind(file);
+	load.buf = malloc(size + 1);
+	load.size = fread(load.buf, 1, size, file);
+	fclose(file);
+	if (argc == 2)
+		load.flags = KO_TEST_LOAD_TRUSTED;
+	// the record count lets the table be sized at once
+	for (offset = 0; offset + sizeof(ko_test_record) <= load.size; load.count++)
+	{
+		rec = (ko_test_record *)((char *)load.buf + offset);
+		offset += KO_TEST_RECORD_SIZE(rec->key_size, rec->value_size);
+	}
+
+	ret = ioctl(fd, KO_TEST_IOCTL_LOAD, &load);
+	free(load.buf);
+	printf("%u records loaded\n", load.count);
+	if (ret == -1)
+	{
+		perror("ioctl - KO_TEST_IOCTL_LOAD");
 		return -1;
 	}
 	return 0;
@@ -189,9 +534,17 @@ static int cmd_read(int fd, int argc, char **argv)
 int main(int argc, char **argv)
 {
 	int fd, arg_int, ret;
+	const char *dev = DEFAULT_DEV;
 
+	// -D <path> selects another table, e.g. /dev/ko_test_device1
+	if (argc > 2 && strcmp(argv[1], "-D") == 0)
+	{
+		dev = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
 	randomize();
-	fd = open(DEFAULT_DEV, O_RDWR);
+	fd = open(dev, O_RDWR);
 	if (fd == -1)
 	{
 		perror("open");
@@ -220,8 +573,26 @@ int main(int argc, char **argv)
 			res = cmd_del(fd, argc, argv);
 		else if (strcmp(command, "get") == 0)
 			res = cmd_get(fd, argc, argv);
+		else if (strcmp(command, "map") == 0)
+			res = cmd_map(fd, argc, argv);
+		else if (strcmp(command, "cas") == 0)
+			res = cmd_cas(fd, argc, argv);
+		else if (strcmp(command, "incr") == 0)
+			res = cmd_incr(fd, argc, argv);
+		else if (strcmp(command, "append") == 0)
+			res = cmd_append(fd, argc, argv);
+		else if (strcmp(command, "mget") == 0)
+			res = cmd_mget(fd, argc, argv);
 		else if (strcmp(command, "read") == 0)
 			res = cmd_read(fd, argc, argv);
+		else if (strcmp(command, "range") == 0)
+			res = cmd_range(fd, argc, argv, false);
+		else if (strcmp(command, "prefix") == 0)
+			res = cmd_range(fd, argc, argv, true);
+		else if (strcmp(command, "dump") == 0)
+			res = cmd_dump(fd, argc, argv);
+		else if (strcmp(command, "load") == 0)
+			res = cmd_load(fd, argc, argv);
 		else
 			printf("unknown command: %s\n", command);
 		if (res != 0)